@@ -0,0 +1,419 @@
+#include <wb/block_tree.hpp>
+#include <wb/frozen_tree.hpp>
+#include <wb/pool.hpp>
+#include <wb/tree.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <ratio>
+#include <set>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Timings for the hot paths of 'wb::tree' and 'wb::block_tree' (and, for
+// searches and iteration, 'wb::frozen_tree'), with 'std::multiset' and a
+// sorted 'std::vector' as baselines, on sequences of uniformly distributed
+// floats of between 1e3 and 1e8 elements. Select a subset with, for example,
+//   wbtree_bench --benchmark_filter='insert.*/1000000$'
+
+namespace {
+
+struct cmp {
+  float a;
+  auto operator()(float x) const { return x <=> a; }
+};
+
+// The same comparison returning an int, for which the tree's searches
+// branch on each result rather than selecting children without branching
+struct int_cmp {
+  float a;
+  int operator()(float x) const { return (x > a) - (x < a); }
+};
+
+using tree = wb::tree<float>;
+using pool_tree = wb::tree<float, wb::compact_pool_allocator<float>>;
+using block_tree = wb::block_tree<float>;
+using frozen = wb::frozen_tree<float>;
+using multiset = std::multiset<float>;
+using vector = std::vector<float>;
+
+constexpr std::int64_t min_size = 1'000;
+constexpr std::int64_t max_size = 100'000'000;
+
+// Insertions and erasures are timed in batches of this many, so that the
+// container stays close to its nominal size
+constexpr std::size_t batch_size = 1024;
+
+std::vector<float> random_values(std::size_t count, unsigned seed) {
+  std::mt19937 urbg(seed);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> values(count);
+  for (auto &value: values) { value = dist(urbg); }
+  return values;
+}
+
+std::vector<float> sorted_values(std::size_t count) {
+  auto values = random_values(count, 1);
+  std::ranges::sort(values);
+  return values;
+}
+
+template <typename C> auto lower_bound(C &c, float value) {
+  if constexpr (std::is_same_v<C, multiset>) {
+    return c.lower_bound(value);
+  } else if constexpr (std::is_same_v<C, vector>) {
+    return std::ranges::lower_bound(c, value);
+  } else {
+    return c.lower_bound(cmp{value});
+  }
+}
+
+template <typename C> auto range_between(C &c, float a, float b) {
+  if constexpr (std::is_same_v<C, multiset>) {
+    return std::make_tuple(c.lower_bound(a), c.upper_bound(b));
+  } else if constexpr (std::is_same_v<C, vector>) {
+    return std::make_tuple(
+      std::ranges::lower_bound(c, a), std::ranges::upper_bound(c, b));
+  } else {
+    return c.range_between(cmp{a}, cmp{b});
+  }
+}
+
+// Insert a value at its lower bound
+template <typename C> void bm_insert(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  auto batch = random_values((std::min)(values.size(), batch_size), 2);
+  std::size_t i{};
+  for (auto _: state) {
+    c.insert(lower_bound(c, batch[i]), batch[i]);
+    if (++i == batch.size()) {
+      state.PauseTiming();
+      for (float value: batch) { c.erase(lower_bound(c, value)); }
+      i = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Erase the element at a value's lower bound
+template <typename C> void bm_erase(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  auto batch = random_values((std::min)(values.size(), batch_size), 2);
+  std::size_t i{};
+  for (auto _: state) {
+    if (!i) {
+      state.PauseTiming();
+      for (float value: batch) { c.insert(lower_bound(c, value), value); }
+      state.ResumeTiming();
+    }
+    c.erase(lower_bound(c, batch[i]));
+    if (++i == batch.size()) { i = 0; }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Insert a sorted batch of 'batch_size' random values, with one call to
+// 'insert_sorted' or one insertion at its lower bound for each value
+template <typename C, bool Sorted>
+void bm_insert_sorted(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  auto batch = random_values(batch_size, 2);
+  std::ranges::sort(batch);
+  for (auto _: state) {
+    if constexpr (Sorted) {
+      c.insert_sorted(batch.begin(), batch.end(),
+        [](float x, float y) { return x <=> y; });
+    } else {
+      for (float value: batch) { c.insert(lower_bound(c, value), value); }
+    }
+    state.PauseTiming();
+    for (float value: batch) { c.erase(lower_bound(c, value)); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+// Insert a burst of 'batch_size' neighbouring values, optionally under a
+// 'deferred_balance' guard (only applicable to 'wb::tree')
+template <typename C, bool Deferred>
+void bm_insert_burst(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  auto batch = random_values(1, 2);
+  float step = 1.0f / (float)values.size() / (float)batch_size;
+  for (auto _: state) {
+    {
+      std::optional<typename C::deferred_balance> guard;
+      if constexpr (Deferred) { guard.emplace(c); }
+      auto position = lower_bound(c, batch[0]);
+      for (std::size_t i = 0; i != batch_size; ++i) {
+        position = c.insert(position, batch[0] - (float)i * step);
+      }
+    }
+    state.PauseTiming();
+    auto first = lower_bound(c, batch[0] - (float)batch_size * step);
+    c.erase(first, std::next(first, batch_size));
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+// Find the first element not less than a random value; for the trees,
+// 'Cmp' selects the branch-free or the branching descent
+template <typename C, typename Cmp = cmp>
+void bm_lower_bound(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  auto batch = random_values(batch_size, 2);
+  std::size_t i{};
+  for (auto _: state) {
+    if constexpr (std::is_same_v<Cmp, cmp>) {
+      benchmark::DoNotOptimize(lower_bound(c, batch[i]));
+    } else {
+      benchmark::DoNotOptimize(c.lower_bound(Cmp{batch[i]}));
+    }
+    if (++i == batch.size()) { i = 0; }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Find the range of about 64 elements between two values
+template <typename C> void bm_range_between(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  auto batch = random_values(batch_size, 2);
+  float width = 64.0f / (float)values.size();
+  std::size_t i{};
+  for (auto _: state) {
+    auto [first, last] = range_between(c, batch[i], batch[i] + width);
+    benchmark::DoNotOptimize(first);
+    benchmark::DoNotOptimize(last);
+    if (++i == batch.size()) { i = 0; }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Exchange the elements at two random positions (not applicable to
+// 'std::multiset', whose order is fixed)
+template <typename C> void bm_exchange_elements(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  std::mt19937 urbg(2);
+  std::uniform_int_distribution<std::size_t> dist(0, values.size() - 1);
+  std::vector<typename C::iterator> positions(2 * batch_size);
+  for (auto &position: positions) {
+    if constexpr (std::is_same_v<C, vector>) {
+      position = c.begin() + dist(urbg);
+    } else {
+      position = c.nth(dist(urbg));
+    }
+  }
+  std::size_t i{};
+  for (auto _: state) {
+    if constexpr (std::is_same_v<C, vector>) {
+      std::iter_swap(positions[i], positions[i + 1]);
+    } else {
+      c.exchange_elements(positions[i], positions[i + 1]);
+    }
+    if ((i += 2) == positions.size()) { i = 0; }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Delta, typename Gamma>
+struct balance_traits: wb::stats_tree_traits {
+  using balance = wb::balance_policy<Delta, Gamma>;
+};
+
+// A mix of 70% searches, 15% insertions and 15% erasures on a tree grown
+// by random insertion, under the balance parameters 'Delta' and 'Gamma'.
+// Besides the throughput, reports the rotations per operation and the
+// average number of nodes on the path from the root to a node.
+template <typename Delta, typename Gamma>
+void bm_balance(benchmark::State &state) {
+  wb::tree<float, std::allocator<float>, balance_traits<Delta, Gamma>> c;
+  for (float value: random_values(state.range(0), 1)) {
+    c.insert(c.lower_bound(cmp{value}), value);
+  }
+  auto batch = random_values(batch_size, 2);
+  c.reset_stats();
+  std::size_t i{};
+  float inserted{};
+  for (auto _: state) {
+    float value = batch[i % batch_size];
+    switch (i % 20) {
+    case 0:
+    case 7:
+    case 14:
+      inserted = value;
+      c.insert(c.lower_bound(cmp{value}), value);
+      break;
+    case 3:
+    case 10:
+    case 17: c.erase(c.lower_bound(cmp{inserted})); break;
+    default: benchmark::DoNotOptimize(c.lower_bound(cmp{value}));
+    }
+    ++i;
+  }
+  auto stats = c.stats();
+  double depth = 0;
+  for (std::size_t d = 0; d != stats.depth_histogram.size(); ++d) {
+    depth += (double)((d + 1) * stats.depth_histogram[d]);
+  }
+  state.counters["rotations"] =
+    (double)(stats.single_rotations + stats.double_rotations) / (double)i;
+  state.counters["depth"] = depth / (double)c.size();
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Reverse a run of 256 neighbouring elements at a random position, with
+// one call to 'reverse' or with 128 calls to 'exchange_elements'
+template <typename C, bool Reverse> void bm_reverse(benchmark::State &state) {
+  constexpr std::size_t run = 256;
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  std::mt19937 urbg(2);
+  std::uniform_int_distribution<std::size_t> dist(0, values.size() - run);
+  for (auto _: state) {
+    auto first = c.nth(dist(urbg));
+    auto last = std::next(first, run);
+    if constexpr (Reverse) {
+      c.reverse(first, last);
+    } else {
+      for (std::size_t i = 0; i != run / 2; ++i) {
+        auto next = std::next(first);
+        --last;
+        c.exchange_elements(first, last);
+        // The iterators followed the values, so they now cross over
+        std::swap(first, last);
+        first = next;
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * run);
+}
+
+// Visit every element in order
+template <typename C> void bm_iterate(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  C c(values.begin(), values.end());
+  for (auto _: state) {
+    float sum{};
+    for (float value: c) { sum += value; }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+// Visit every element in order, by iterator or with 'for_each', in a tree
+// whose nodes were allocated in random order, as after random insertions
+template <typename C, bool ForEach> void bm_traverse(benchmark::State &state) {
+  auto values = random_values(state.range(0), 1);
+  C c;
+  for (float value: values) { c.insert(lower_bound(c, value), value); }
+  for (auto _: state) {
+    float sum{};
+    if constexpr (ForEach) {
+      c.for_each([&sum](float value) { sum += value; });
+    } else {
+      for (float value: c) { sum += value; }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+// Destroy a container
+template <typename C> void bm_destroy(benchmark::State &state) {
+  auto values = sorted_values(state.range(0));
+  std::optional<C> c;
+  for (auto _: state) {
+    state.PauseTiming();
+    c.emplace(values.begin(), values.end());
+    state.ResumeTiming();
+    c.reset();
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+}
+
+BENCHMARK_TEMPLATE(bm_insert, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert, block_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert, multiset)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_erase, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_erase, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_erase, block_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_erase, multiset)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_erase, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_insert_sorted, tree, false)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert_sorted, tree, true)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert_sorted, pool_tree, false)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert_sorted, pool_tree, true)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_insert_burst, tree, false)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert_burst, tree, true)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert_burst, pool_tree, false)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_insert_burst, pool_tree, true)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_lower_bound, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_lower_bound, tree, int_cmp)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_lower_bound, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_lower_bound, pool_tree, int_cmp)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_lower_bound, frozen)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_lower_bound, multiset)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_lower_bound, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_range_between, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_range_between, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_range_between, block_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_range_between, frozen)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_range_between, multiset)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_range_between, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_exchange_elements, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_exchange_elements, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_exchange_elements, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_balance, std::ratio<5, 2>, std::ratio<3, 2>)->RangeMultiplier(10)->Range(min_size, max_size / 100);
+BENCHMARK_TEMPLATE(bm_balance, std::ratio<3>, std::ratio<2>)->RangeMultiplier(10)->Range(min_size, max_size / 100);
+BENCHMARK_TEMPLATE(bm_balance, std::ratio<13, 4>, std::ratio<7, 4>)->RangeMultiplier(10)->Range(min_size, max_size / 100);
+BENCHMARK_TEMPLATE(bm_balance, std::ratio<4>, std::ratio<3, 2>)->RangeMultiplier(10)->Range(min_size, max_size / 100);
+
+BENCHMARK_TEMPLATE(bm_reverse, tree, false)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_reverse, tree, true)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_reverse, pool_tree, false)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_reverse, pool_tree, true)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_iterate, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_iterate, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_iterate, block_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_iterate, frozen)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_iterate, multiset)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_iterate, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_TEMPLATE(bm_traverse, tree, false)->RangeMultiplier(10)->Range(min_size, max_size / 10);
+BENCHMARK_TEMPLATE(bm_traverse, tree, true)->RangeMultiplier(10)->Range(min_size, max_size / 10);
+BENCHMARK_TEMPLATE(bm_traverse, pool_tree, false)->RangeMultiplier(10)->Range(min_size, max_size / 10);
+BENCHMARK_TEMPLATE(bm_traverse, pool_tree, true)->RangeMultiplier(10)->Range(min_size, max_size / 10);
+
+BENCHMARK_TEMPLATE(bm_destroy, tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_destroy, pool_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_destroy, block_tree)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_destroy, multiset)->RangeMultiplier(10)->Range(min_size, max_size);
+BENCHMARK_TEMPLATE(bm_destroy, vector)->RangeMultiplier(10)->Range(min_size, max_size);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,127 @@
+#include <wb/sweep.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <vector>
+
+// Timings for 'wb::sweep_intersections' on generated sets of segments, from
+// random to degenerate, as an end-to-end workload for 'wb::tree'. Each
+// benchmark reports the event points processed per second ('events') and
+// the number of points where segments meet ('meetings'). Select a subset
+// with, for example,
+//   sweep_bench --benchmark_filter='collinear/100000$'
+
+namespace {
+
+using segments = std::vector<wb::sweep_segment>;
+
+// The coordinates lie in [-extent, extent]
+constexpr std::int32_t extent = (1 << 18) - 1;
+
+// Segments of random direction with lengths about the average spacing of
+// their midpoints, so that the number of crossings grows linearly
+segments random_segments(std::size_t count) {
+  std::mt19937 urbg(1);
+  std::uniform_int_distribution<std::int32_t> position(-extent / 2, extent / 2);
+  double length = 2.0 * extent / std::sqrt((double)count);
+  std::uniform_real_distribution<double> angle(0.0, 6.283185307179586);
+  segments result(count);
+  for (auto &[a, b]: result) {
+    a = {position(urbg), position(urbg)};
+    double t = angle(urbg);
+    b = {a.x + (std::int32_t)(length * std::cos(t)),
+      a.y + (std::int32_t)(length * std::sin(t))};
+  }
+  return result;
+}
+
+// Horizontal and vertical segments on a coarse lattice, which overlap
+// their collinear neighbours, share endpoints and meet at lattice points
+segments grid_segments(std::size_t count) {
+  std::mt19937 urbg(2);
+  std::int32_t lines = (std::int32_t)std::sqrt((double)count) / 2 + 1;
+  std::int32_t step = extent / lines;
+  std::uniform_int_distribution<std::int32_t> line(-lines, lines);
+  std::uniform_int_distribution<std::int32_t> span(1, 4);
+  segments result(count);
+  for (std::size_t i = 0; i != count; ++i) {
+    std::int32_t u = line(urbg) * step;
+    std::int32_t v = (std::clamp)(line(urbg), -lines, lines - 4) * step;
+    std::int32_t w = v + span(urbg) * step;
+    result[i] = i % 2 ? wb::sweep_segment{{u, v}, {u, w}}
+                      : wb::sweep_segment{{v, u}, {w, u}};
+  }
+  return result;
+}
+
+// Overlapping segments on a few lines of two slopes, about eight deep on
+// each line, so that most event points lie on several segments
+segments collinear_segments(std::size_t count) {
+  std::mt19937 urbg(3);
+  std::uniform_int_distribution<std::int32_t> offset(-8, 8);
+  std::uniform_int_distribution<std::int32_t> position(-extent / 8, extent / 8);
+  std::uniform_int_distribution<std::int32_t> length(
+    1, (std::int32_t)(128 * (std::int64_t)extent / (std::int64_t)count) + 1);
+  segments result(count);
+  for (std::size_t i = 0; i != count; ++i) {
+    // Lines of slopes 1/2 and -1/4 through the points '(0, 4096 k)'
+    std::int32_t x = 4 * position(urbg), k = offset(urbg) * 4096;
+    std::int32_t l = 4 * length(urbg);
+    if (i % 2) {
+      result[i] = {{x, x / 2 + k}, {x + l, (x + l) / 2 + k}};
+    } else {
+      result[i] = {{x, k - x / 4}, {x + l, k - (x + l) / 4}};
+    }
+  }
+  return result;
+}
+
+// Stars of 64 segments through a common centre at evenly spaced angles,
+// sized so that neighbouring stars overlap a little
+segments star_segments(std::size_t count) {
+  std::mt19937 urbg(4);
+  std::size_t rays = 64;
+  std::uniform_int_distribution<std::int32_t> position(-extent / 2, extent / 2);
+  double radius = extent / 2 / std::sqrt((double)count / (double)rays);
+  segments result;
+  result.reserve(count);
+  while (result.size() != count) {
+    wb::sweep_point c{position(urbg), position(urbg)};
+    for (std::size_t i = 0; i != rays && result.size() != count; ++i) {
+      double t = 3.141592653589793 * (double)i / (double)rays;
+      auto dx = (std::int32_t)(radius * std::cos(t));
+      auto dy = (std::int32_t)(radius * std::sin(t));
+      result.push_back({{c.x - dx, c.y - dy}, {c.x + dx, c.y + dy}});
+    }
+  }
+  return result;
+}
+
+void bm_sweep(benchmark::State &state, segments (*generate)(std::size_t)) {
+  auto input = generate((std::size_t)state.range(0));
+  std::size_t events = 0, meetings = 0;
+  for (auto _: state) {
+    events += wb::sweep_intersections(input,
+      [&meetings](const wb::sweep_event_point &, std::span<const std::size_t>) {
+        ++meetings;
+      });
+  }
+  state.counters["events"] =
+    benchmark::Counter((double)events, benchmark::Counter::kIsRate);
+  state.counters["meetings"] = (double)meetings / (double)state.iterations();
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+}
+
+BENCHMARK_CAPTURE(bm_sweep, random, random_segments)->RangeMultiplier(10)->Range(1'000, 1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(bm_sweep, grid, grid_segments)->RangeMultiplier(10)->Range(1'000, 1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(bm_sweep, collinear, collinear_segments)->RangeMultiplier(10)->Range(1'000, 1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(bm_sweep, star, star_segments)->RangeMultiplier(10)->Range(1'000, 100'000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
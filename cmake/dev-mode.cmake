@@ -5,6 +5,11 @@ if(BUILD_TESTING)
   add_subdirectory(test)
 endif()
 
+option(wbtree_BUILD_BENCHMARKS "Build the benchmarks (needs Google Benchmark)" OFF)
+if(wbtree_BUILD_BENCHMARKS)
+  add_subdirectory(bench)
+endif()
+
 include(cmake/lint-targets.cmake)
 
 add_folders(Project)
@@ -12,6 +12,7 @@ default(
     source/*.cpp source/*.hpp
     include/*.hpp
     test/*.cpp test/*.hpp
+    bench/*.cpp bench/*.hpp
     example/*.cpp example/*.hpp
 )
 default(FIX NO)
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "persistent_tree.hpp"
+
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+// A single-writer, multiple-reader wrapper for 'wb::persistent_tree'.
+
+// The class template 'concurrent_tree' holds a current version of a
+// 'persistent_tree' that any number of threads may read while writers,
+// serialized by a mutex, modify a private working copy. After each write
+// the working copy is published, in constant time, as the new current
+// version. Readers never wait for a write in progress: 'snapshot()' and
+// 'read' take a shared pointer to the current version under a second
+// mutex, which is held only to copy or replace that pointer, and the
+// version stays valid as long as the reader holds it, however far the
+// writers have moved on.
+
+// Nodes are reclaimed by the reference counts of 'persistent_tree', so a
+// node removed by a writer is freed only once the last version containing
+// it has been dropped; the allocator must be safe to use from every thread
+// that drops a version (which 'wb::pool_allocator' is not). A writer copies
+// the O(log n) nodes on each modified path that are shared with a
+// published version, so several modifications made in one call to 'write'
+// are cheaper than the same modifications made in separate calls.
+
+// The class template 'concurrent_tree' provides the following methods:
+//   concurrent_tree(); // default constructor
+//   explicit concurrent_tree(const Allocator &alloc);
+//   concurrent_tree(first, last, alloc = Allocator());
+//   tree_type snapshot() const; // the current version
+//   std::size_t size() const; // the size of the current version
+//   read(f) const; // return f(version) for the current version
+//   write(f); // return f(working copy), then publish the working copy
+// where 'tree_type' is 'persistent_tree<T, Allocator>'. The function
+// passed to 'write' may call any method of the working copy, but must not
+// let a reference to it escape. If it throws, or publishing throws, which
+// it may when it allocates, the working copy is rolled back to the current
+// version, which is unchanged, before the exception propagates.
+
+namespace wb {
+
+template <typename T, typename Allocator = std::allocator<T>>
+struct concurrent_tree {
+  using tree_type = persistent_tree<T, Allocator>;
+  using value_type = T;
+  using allocator_type = Allocator;
+
+private:
+  std::mutex mutex_;
+  tree_type working_;
+  mutable std::mutex current_mutex_;
+  std::shared_ptr<const tree_type> current_;
+
+  // Make the working copy the current version; call with 'mutex_' held.
+  // The previous version is dropped, releasing any nodes that no other
+  // version shares, after 'current_mutex_' is unlocked.
+  void publish() {
+    auto version = std::make_shared<const tree_type>(working_);
+    std::lock_guard lock(current_mutex_);
+    current_.swap(version);
+  }
+
+  std::shared_ptr<const tree_type> current() const {
+    std::lock_guard lock(current_mutex_);
+    return current_;
+  }
+
+public:
+  concurrent_tree(): concurrent_tree(Allocator()) {}
+
+  explicit concurrent_tree(const Allocator &alloc): working_(alloc) {
+    publish();
+  }
+
+  template <std::input_iterator I, std::sentinel_for<I> S>
+  concurrent_tree(I first, S last, const Allocator &alloc = Allocator()):
+      working_(first, last, alloc) {
+    publish();
+  }
+
+  concurrent_tree(const concurrent_tree &) = delete;
+  concurrent_tree &operator=(const concurrent_tree &) = delete;
+
+  tree_type snapshot() const { return *current(); }
+
+  std::size_t size() const { return current()->size(); }
+
+  // Return 'f(version)' for the current version, which stays alive until
+  // 'f' returns
+  template <typename F> decltype(auto) read(F &&f) const {
+    std::shared_ptr<const tree_type> version = current();
+    return ((F &&)f)(*version);
+  }
+
+  // Return 'f(working)' for the working copy, then publish it; if either
+  // throws, roll the working copy back to the current version in constant
+  // time, so that nothing of the failed write is published
+  template <typename F> decltype(auto) write(F &&f) {
+    std::lock_guard lock(mutex_);
+    try {
+      if constexpr (std::is_void_v<std::invoke_result_t<F, tree_type &>>) {
+        ((F &&)f)(working_);
+        publish();
+      } else {
+        decltype(auto) result = ((F &&)f)(working_);
+        publish();
+        return result;
+      }
+    } catch (...) {
+      working_ = *current_;
+      throw;
+    }
+  }
+};
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+
+// Execution policies for the parallel algorithms of 'wb::tree' (see also
+// 'parallel.hpp').
+
+// The policy 'wb::seq' runs everything on the calling thread. A
+// 'wb::parallel_policy' divides the work into chunks of at least
+// 'grain_size' elements and runs them on up to 'thread_count' threads,
+// including the calling thread; a 'thread_count' of zero means the
+// hardware concurrency. 'wb::par' is a parallel policy with the defaults.
+
+// The standard execution policies are not used because, with libstdc++,
+// including '<execution>' requires linking with TBB wherever it is installed.
+// As with any program that starts threads, link with 'Threads::Threads'
+// where the platform requires it.
+
+namespace wb {
+
+struct sequenced_policy {};
+
+struct parallel_policy {
+  unsigned thread_count{};
+  std::size_t grain_size{4096};
+};
+
+inline constexpr sequenced_policy seq{};
+inline constexpr parallel_policy par{};
+
+template <typename P>
+concept execution_policy =
+  std::same_as<std::remove_cvref_t<P>, sequenced_policy> ||
+  std::same_as<std::remove_cvref_t<P>, parallel_policy>;
+
+namespace detail {
+
+// The number of threads to use under 'policy'
+inline unsigned thread_count(const sequenced_policy &) { return 1; }
+
+inline unsigned thread_count(const parallel_policy &policy) {
+  unsigned count = policy.thread_count;
+  if (!count) { count = std::thread::hardware_concurrency(); }
+  return (std::max)(count, 1u);
+}
+
+// The number of chunks into which to divide 'n' elements under 'policy'
+inline std::size_t chunk_count(const sequenced_policy &, std::size_t) {
+  return 1;
+}
+
+inline std::size_t chunk_count(const parallel_policy &policy, std::size_t n) {
+  // A few chunks per thread even out uneven progress
+  std::size_t grain = (std::max)(policy.grain_size, std::size_t{1});
+  return (std::max)(std::size_t{1},
+    (std::min)(n / grain, std::size_t{4} * thread_count(policy)));
+}
+
+// The number of levels of a divide-and-conquer recursion at which to fork
+// under 'policy', enough to give each thread at least one task
+inline int fork_depth(const sequenced_policy &) { return 0; }
+
+inline int fork_depth(const parallel_policy &policy) {
+  return std::bit_width(thread_count(policy) - 1u);
+}
+
+// The least problem size at which to fork under 'policy'
+inline std::size_t grain_size(const sequenced_policy &) { return -1; }
+
+inline std::size_t grain_size(const parallel_policy &policy) {
+  return policy.grain_size;
+}
+
+// Call 'left()' on a new thread and 'right()' on the calling thread and
+// wait for both if 'fork' is true, otherwise call both on the calling thread
+template <typename L, typename R>
+void fork_join(bool fork, L &&left, R &&right) {
+  if (fork) {
+    std::jthread thread((L &&)left);
+    right();
+  } else {
+    left();
+    right();
+  }
+}
+
+}
+
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "node.hpp"
+#include "tree.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <tuple>
+#include <utility>
+
+// An immutable, contiguous copy of a sequence, laid out for fast search.
+
+// The class template 'frozen_tree' holds the values of a sequence in one
+// array in Eytzinger (breadth-first) order: the root of a perfectly
+// balanced tree first, then its two children, then the four nodes below
+// them, and so on, so that the children of the node at position 'k'
+// (counting from one) are at '2k' and '2k + 1'. A search reads one value
+// per level, with no pointers to chase, and the nodes of the next few
+// levels below the current one are adjacent, so their cache line can be
+// prefetched while the current comparison is made. The descent also
+// avoids data-dependent branches, so it suffers no mispredictions.
+
+// 'freeze(tree)' returns a frozen copy of a 'wb::tree', for read-mostly
+// phases, in linear time; a frozen tree can also be built from any ordered
+// forward range.
+// It supports the binary search methods 'lower_bound(cmp)',
+// 'upper_bound(cmp)', 'equal_range(cmp)' and 'range_between(lcmp, rcmp)'
+// with the same comparator contract as 'wb::tree', and bidirectional
+// iteration in sequence order. Stepping an iterator moves between levels
+// of the implicit tree, so it costs amortized constant time but, unlike a
+// search, jumps around the array.
+
+// The class template 'frozen_tree' provides the following methods:
+//   frozen_tree(); // default constructor
+//   explicit frozen_tree(const Allocator &alloc);
+//   frozen_tree(first, last, alloc = Allocator());
+//   allocator_type get_allocator() const;
+//   const_iterator begin() const;
+//   const_iterator end() const;
+//   std::size_t size() const;
+//   bool empty() const;
+//   const_iterator lower_bound(cmp) const;
+//   const_iterator upper_bound(cmp) const;
+//   std::tuple<const_iterator, const_iterator> equal_range(cmp) const;
+//   std::tuple<const_iterator, const_iterator> range_between(
+//     lcmp, rcmp) const;
+// with the same meanings as for 'wb::tree'. A frozen tree can be copied
+// and moved like a vector; its iterators are invalidated only when it is
+// assigned to or destroyed. The values are constructed straight into their
+// positions, which are not filled in order, so the values need not be
+// default-constructible or assignable.
+
+namespace wb {
+
+template <typename T, typename Allocator = std::allocator<T>>
+struct frozen_tree {
+  using allocator_type = Allocator;
+  using value_type = T;
+
+private:
+  using alloc_traits = std::allocator_traits<Allocator>;
+
+  // The values in Eytzinger order; the node at position 'k' is 'values_[k - 1]'
+  [[no_unique_address]] Allocator alloc_;
+  T *values_{};
+  std::size_t size_{};
+
+  // The descendants 'stride' levels down from position 'k' start at
+  // position 'stride * k', and those of one node share a cache line
+  static constexpr std::size_t stride =
+    std::bit_floor((std::max)(std::size_t{64} / sizeof(T), std::size_t{2}));
+
+  // The position of the first value 'x' for which 'before(x)' is false, or
+  // zero if there is none. Going left or right is 'k = 2k + before(x)';
+  // the answer is the last node at which the descent went left, which is
+  // found by cancelling the trailing right turns and then the left turn.
+  std::size_t descend(auto &&before) const {
+    std::size_t n = size_;
+    std::size_t k = 1;
+    while (k <= n) {
+      detail::prefetch(values_ + ((std::min)(stride * k, n) - 1));
+      k = 2 * k + (std::size_t)(bool)before(values_[k - 1]);
+    }
+    return k >> (std::countr_one(k) + 1);
+  }
+
+public:
+  struct const_iterator {
+  private:
+    friend struct frozen_tree;
+    const T *values_;
+    std::size_t size_;
+    std::size_t k_; // position in Eytzinger order, or zero at the end
+
+    const_iterator(const T *values, std::size_t size, std::size_t k):
+        values_(values), size_(size), k_(k) {}
+
+  public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = const T *;
+    using reference = const T &;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    // Singular value required for range iterator
+    const_iterator(): values_(nullptr), size_(0), k_(0) {}
+
+    const T &operator*() const { return values_[k_ - 1]; }
+    const T *operator->() const { return values_ + (k_ - 1); }
+
+    // Go to the leftmost node of the right subtree, if any, or else climb
+    // out of the right subtrees to the parent reached from its left
+    const_iterator &operator++() {
+      if (2 * k_ + 1 <= size_) {
+        k_ = 2 * k_ + 1;
+        while (2 * k_ <= size_) { k_ = 2 * k_; }
+      } else {
+        k_ >>= std::countr_one(k_) + 1;
+      }
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator result = *this;
+      ++*this;
+      return result;
+    }
+
+    // The mirror image of '++', where decrementing 'end()' goes to the
+    // rightmost node
+    const_iterator &operator--() {
+      if (!k_) {
+        k_ = 1;
+        while (2 * k_ + 1 <= size_) { k_ = 2 * k_ + 1; }
+      } else if (2 * k_ <= size_) {
+        k_ = 2 * k_;
+        while (2 * k_ + 1 <= size_) { k_ = 2 * k_ + 1; }
+      } else {
+        k_ >>= std::countr_zero(k_) + 1;
+      }
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator result = *this;
+      --*this;
+      return result;
+    }
+
+    bool operator==(const const_iterator &other) const {
+      return k_ == other.k_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return k_ != other.k_;
+    }
+  };
+
+  using iterator = const_iterator;
+
+  // Call 'f(k)' on the positions of the first 'count' values in sequence
+  // order, by an in-order walk of the implicit tree
+  template <typename F> void walk(std::size_t count, F &&f) const {
+    auto visit = [&](auto &self, std::size_t k) -> void {
+      if (k <= size_ && count) {
+        self(self, 2 * k);
+        if (count) {
+          f(k);
+          --count;
+        }
+        self(self, 2 * k + 1);
+      }
+    };
+    visit(visit, 1);
+  }
+
+  // Destroy the first 'count' values in sequence order and free the array
+  void release(std::size_t count) noexcept {
+    if (!values_) { return; }
+    if (count == size_) {
+      for (std::size_t k = 0; k != size_; ++k) {
+        alloc_traits::destroy(alloc_, values_ + k);
+      }
+    } else {
+      walk(count, [this](std::size_t k) {
+        alloc_traits::destroy(alloc_, values_ + (k - 1));
+      });
+    }
+    alloc_traits::deallocate(alloc_, values_, size_);
+    values_ = nullptr;
+    size_ = 0;
+  }
+
+public:
+  frozen_tree(): frozen_tree(Allocator()) {}
+
+  explicit frozen_tree(const Allocator &alloc): alloc_(alloc) {}
+
+  // The values are copied straight into their positions by an in-order
+  // walk of the implicit tree, with nothing else allocated; counting the
+  // range takes another pass unless its iterator and sentinel are sized
+  template <std::forward_iterator I, std::sentinel_for<I> S>
+  frozen_tree(I first, S last, const Allocator &alloc = Allocator()):
+      alloc_(alloc) {
+    std::size_t n = (std::size_t)std::ranges::distance(first, last);
+    if (!n) { return; }
+    values_ = alloc_traits::allocate(alloc_, n);
+    size_ = n;
+    std::size_t made = 0;
+    try {
+      walk(n, [&](std::size_t k) {
+        alloc_traits::construct(alloc_, values_ + (k - 1), *first);
+        ++first;
+        ++made;
+      });
+    } catch (...) {
+      release(made);
+      throw;
+    }
+  }
+
+  frozen_tree(const frozen_tree &other):
+      alloc_(alloc_traits::select_on_container_copy_construction(
+        other.alloc_)) {
+    if (!other.size_) { return; }
+    values_ = alloc_traits::allocate(alloc_, other.size_);
+    size_ = other.size_;
+    std::size_t k = 0;
+    try {
+      for (; k != size_; ++k) {
+        alloc_traits::construct(alloc_, values_ + k, other.values_[k]);
+      }
+    } catch (...) {
+      for (; k; --k) { alloc_traits::destroy(alloc_, values_ + (k - 1)); }
+      alloc_traits::deallocate(alloc_, values_, size_);
+      throw;
+    }
+  }
+
+  frozen_tree(frozen_tree &&other) noexcept:
+      alloc_(std::move(other.alloc_)),
+      values_(std::exchange(other.values_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {}
+
+  // Copy or move 'other' aside first, so that this is unchanged if copying
+  // throws
+  frozen_tree &operator=(frozen_tree other) noexcept {
+    release(size_);
+    alloc_ = std::move(other.alloc_);
+    values_ = std::exchange(other.values_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+    return *this;
+  }
+
+  ~frozen_tree() { release(size_); }
+
+  allocator_type get_allocator() const { return alloc_; }
+
+  const_iterator begin() const {
+    std::size_t k = size_ ? 1 : 0;
+    while (2 * k <= size_ && k) { k = 2 * k; }
+    return const_iterator(values_, size_, k);
+  }
+
+  const_iterator end() const { return const_iterator(values_, size_, 0); }
+
+  std::size_t size() const { return size_; }
+
+  bool empty() const { return !size_; }
+
+  // Return an iterator to the first element 'x' for which 'cmp(x) < 0'
+  // is false
+  template <typename Comp> const_iterator lower_bound(Comp &&cmp) const {
+    std::size_t k = descend([&cmp](const T &x) { return cmp(x) < 0; });
+    return const_iterator(values_, size_, k);
+  }
+
+  // Return an iterator to the first element 'x' for which 'cmp(x) <= 0'
+  // is false
+  template <typename Comp> const_iterator upper_bound(Comp &&cmp) const {
+    std::size_t k = descend([&cmp](const T &x) { return cmp(x) <= 0; });
+    return const_iterator(values_, size_, k);
+  }
+
+  template <typename Comp>
+  std::tuple<const_iterator, const_iterator> equal_range(Comp &&cmp) const {
+    return std::make_tuple(lower_bound(cmp), upper_bound(cmp));
+  }
+
+  template <typename LComp, typename RComp>
+  std::tuple<const_iterator, const_iterator> range_between(
+    LComp &&lcmp, RComp &&rcmp) const {
+    return std::make_tuple(lower_bound(lcmp), upper_bound(rcmp));
+  }
+};
+
+static_assert(std::bidirectional_iterator<frozen_tree<int>::const_iterator>);
+
+// Return a frozen copy of the elements of 't', walking it once with its
+// iterators. The copy uses the standard allocator rather than the tree's,
+// which may be a pool of single nodes.
+template <typename T, typename Allocator, typename Traits>
+frozen_tree<T> freeze(const tree<T, Allocator, Traits> &t) {
+  return frozen_tree<T>(
+    std::counted_iterator(t.begin(), (std::ptrdiff_t)t.size()),
+    std::default_sentinel);
+}
+
+}
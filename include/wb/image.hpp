@@ -0,0 +1,202 @@
+#pragma once
+
+#include "tree.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// A binary image of a sequence, for checkpoints that are mapped back in.
+
+// 'serialize(tree, out)' writes the elements of a 'wb::tree' of trivially
+// copyable values to a stream as an image: a 32-byte header followed by
+// the values' bytes in sequence order, starting at an offset aligned for
+// 'T'. The header records a magic number, the format version, the size and
+// alignment of 'T' and the number of values. Integers and values are in
+// the writing machine's representation, so an image is only portable
+// between machines that agree on it.
+
+// 'load(tree, image)' replaces a tree's elements with those of an image in
+// linear time, building the balanced shape directly as 'assign' does,
+// without calling any comparator. The sizes of the subtrees are implied by
+// the shape, so the image need not store them.
+
+// The class template 'image_view' searches an image in place, for example
+// one mapped read-only into memory with 'mmap', so that a process can
+// answer queries from a large checkpoint as soon as it maps it, faulting in
+// only the pages that the searches touch:
+//   int fd = open(path, O_RDONLY);
+//   void *p = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+//   wb::image_view<float> view(
+//     std::span(static_cast<const std::byte *>(p), bytes));
+//   auto [first, last] = view.range_between(lcmp, rcmp);
+// The values form a sorted array, so the view's iterators are pointers and
+// its binary search methods 'lower_bound(cmp)', 'upper_bound(cmp)',
+// 'equal_range(cmp)' and 'range_between(lcmp, rcmp)' have the same
+// comparator contract as for 'wb::tree'. Constructing a view checks the
+// header against 'T' and the length and alignment of the bytes, and throws
+// 'std::invalid_argument' if they do not match; so does 'load'. The view
+// refers to the bytes without copying them, and must not outlive them.
+
+// The class template 'image_view' provides the following methods:
+//   explicit image_view(std::span<const std::byte> image);
+//   const T *begin() const;
+//   const T *end() const;
+//   std::size_t size() const;
+//   bool empty() const;
+//   const T *lower_bound(cmp) const;
+//   const T *upper_bound(cmp) const;
+//   std::tuple<const T *, const T *> equal_range(cmp) const;
+//   std::tuple<const T *, const T *> range_between(lcmp, rcmp) const;
+
+namespace wb {
+
+// The header at the start of an image
+struct image_header {
+  char magic[8];
+  std::uint32_t value_size;
+  std::uint32_t value_alignment;
+  std::uint64_t count;
+  std::uint64_t reserved;
+};
+
+static_assert(sizeof(image_header) == 32);
+
+namespace detail {
+
+inline constexpr char image_magic[8] = {'w', 'b', 't', 'r', 'e', 'e', 0, 1};
+
+// The offset of the values in an image of 'T'
+template <typename T>
+inline constexpr std::size_t image_values_offset =
+  (std::max)(sizeof(image_header), alignof(T));
+
+// Write an image of the 'count' values passed in order to the callback
+// given to 'visit', buffering them to write them in large blocks
+template <typename T>
+void write_image(std::ostream &out, std::size_t count, auto &&visit) {
+  image_header header{};
+  std::memcpy(header.magic, image_magic, sizeof header.magic);
+  header.value_size = sizeof(T);
+  header.value_alignment = alignof(T);
+  header.count = count;
+  out.write(reinterpret_cast<const char *>(&header), sizeof header);
+  char padding[image_values_offset<T>]{};
+  out.write(padding, image_values_offset<T> - sizeof header);
+  std::vector<T> buffer;
+  buffer.reserve((std::max)(std::size_t{1}, std::size_t{65536} / sizeof(T)));
+  auto flush = [&] {
+    out.write(reinterpret_cast<const char *>(buffer.data()),
+      (std::streamsize)(buffer.size() * sizeof(T)));
+    buffer.clear();
+  };
+  visit([&](const T &x) {
+    buffer.push_back(x);
+    if (buffer.size() == buffer.capacity()) { flush(); }
+  });
+  flush();
+}
+
+// The values of an image of 'T', after checking its header, length and
+// alignment
+template <typename T>
+std::span<const T> image_values(std::span<const std::byte> image) {
+  image_header header;
+  if (image.size() < sizeof header) {
+    throw std::invalid_argument("wb: image is too short");
+  }
+  std::memcpy(&header, image.data(), sizeof header);
+  if (std::memcmp(header.magic, image_magic, sizeof header.magic) ||
+      header.value_size != sizeof(T) ||
+      header.value_alignment != alignof(T)) {
+    throw std::invalid_argument("wb: image does not hold values of this type");
+  }
+  std::size_t available = image.size() < image_values_offset<T>
+                            ? 0
+                            : image.size() - image_values_offset<T>;
+  if (header.count > available / sizeof(T)) {
+    throw std::invalid_argument("wb: image is truncated");
+  }
+  const std::byte *values = image.data() + image_values_offset<T>;
+  if (reinterpret_cast<std::uintptr_t>(values) % alignof(T)) {
+    throw std::invalid_argument("wb: image is misaligned");
+  }
+  return {reinterpret_cast<const T *>(values), (std::size_t)header.count};
+}
+
+}
+
+template <typename T> struct image_view {
+  static_assert(std::is_trivially_copyable_v<T>,
+    "images hold trivially copyable values");
+
+  using value_type = T;
+  using const_iterator = const T *;
+  using iterator = const_iterator;
+
+private:
+  std::span<const T> values_;
+
+public:
+  explicit image_view(std::span<const std::byte> image):
+      values_(detail::image_values<T>(image)) {}
+
+  const T *begin() const { return values_.data(); }
+  const T *end() const { return values_.data() + values_.size(); }
+
+  std::size_t size() const { return values_.size(); }
+
+  bool empty() const { return values_.empty(); }
+
+  // Return a pointer to the first element 'x' for which 'cmp(x) < 0' is
+  // false
+  template <typename Comp> const T *lower_bound(Comp &&cmp) const {
+    return std::partition_point(
+      begin(), end(), [&cmp](const T &x) { return cmp(x) < 0; });
+  }
+
+  // Return a pointer to the first element 'x' for which 'cmp(x) <= 0' is
+  // false
+  template <typename Comp> const T *upper_bound(Comp &&cmp) const {
+    return std::partition_point(
+      begin(), end(), [&cmp](const T &x) { return cmp(x) <= 0; });
+  }
+
+  template <typename Comp>
+  std::tuple<const T *, const T *> equal_range(Comp &&cmp) const {
+    return std::make_tuple(lower_bound(cmp), upper_bound(cmp));
+  }
+
+  template <typename LComp, typename RComp>
+  std::tuple<const T *, const T *> range_between(
+    LComp &&lcmp, RComp &&rcmp) const {
+    return std::make_tuple(lower_bound(lcmp), upper_bound(rcmp));
+  }
+};
+
+// Write an image of the elements of 't' to 'out'
+template <typename T, typename Allocator, typename Traits>
+void serialize(const tree<T, Allocator, Traits> &t, std::ostream &out)
+  requires(std::is_trivially_copyable_v<T>)
+{
+  detail::write_image<T>(out, t.size(), [&t](auto &&f) { t.for_each(f); });
+}
+
+// Make the elements of 't' a copy of the values in 'image', as 'assign'
+// would
+template <typename T, typename Allocator, typename Traits>
+void load(tree<T, Allocator, Traits> &t, std::span<const std::byte> image)
+  requires(std::is_trivially_copyable_v<T>)
+{
+  std::span<const T> values = detail::image_values<T>(image);
+  t.assign(values.begin(), values.end());
+}
+
+}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include "node.hpp"
+
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// A variant of 'wb::tree' whose links live in the elements themselves.
+
+// The class template 'intrusive_tree' represents a sequence of objects
+// allowing binary search with arbitrary comparators, like 'wb::tree', but
+// it neither owns, copies nor allocates its elements: each object carries
+// the links and subtree size of its node in a base class 'intrusive_hook',
+// and the tree links existing objects together. Inserting and erasing
+// never allocate, a comparator is called on the object itself rather than
+// on a copy in a separate node, and 'iterator_to(x)' finds the iterator to
+// an object in constant time. The balancing is that of 'wb::tree', and
+// shares its code.
+
+// An object may belong to several intrusive trees at once through hooks
+// with distinct tags:
+//   struct by_x; struct by_y;
+//   struct segment: wb::intrusive_hook<by_x>, wb::intrusive_hook<by_y> {
+//     ...
+//   };
+//   wb::intrusive_tree<segment, by_x> xs;
+//   wb::intrusive_tree<segment, by_y> ys;
+// (Member hooks, named by a pointer to member, would need the offset of
+// the member to get from a node back to its object, which C++ provides no
+// portable way to compute; base classes convert with 'static_cast'.)
+
+// The user keeps an object alive, and at the same address, while it is in
+// a tree, and erases it before destroying it. Copying an object copies
+// its hook as unlinked, so a copy is not in any tree. 'is_linked()' tells
+// whether a hook is in a tree.
+
+// The class template 'intrusive_tree' provides the following methods:
+//   intrusive_tree(); // default constructor
+//   intrusive_tree(intrusive_tree &&other); // move constructor
+//   intrusive_tree &operator=(intrusive_tree &&other);
+//   ~intrusive_tree(); // unlinks every element
+//   iterator begin();
+//   iterator end();
+//   const_iterator begin() const;
+//   const_iterator end() const;
+//   std::size_t size() const;
+//   bool empty() const;
+//   iterator iterator_to(T &x);
+//   const_iterator iterator_to(const T &x) const;
+//   iterator insert(iterator position, T &x); // link 'x' before 'position'
+//   iterator erase(iterator position); // unlink, returning the successor
+//   void clear(); // unlink every element
+//   void exchange_elements(iterator i, iterator j);
+//   iterator nth(std::size_t index);
+//   std::size_t rank(const_iterator i) const;
+//   iterator lower_bound(cmp);
+//   iterator upper_bound(cmp);
+//   std::tuple<iterator, iterator> equal_range(cmp);
+//   std::tuple<iterator, iterator> range_between(lcmp, rcmp);
+//   bool valid() const; // check structural invariants, for testing
+// with the same meanings and iterator rules as for 'wb::tree'. Moving a
+// tree invalidates only 'end()'.
+
+namespace wb {
+
+namespace detail {
+
+// The empty value of an intrusive hook's node
+template <typename Tag> struct hook_value {};
+
+}
+
+template <typename Tag = void>
+struct intrusive_hook: private detail::node<detail::hook_value<Tag>> {
+  intrusive_hook() noexcept { reset(); }
+
+  // A copy is not linked into any tree
+  intrusive_hook(const intrusive_hook &) noexcept: intrusive_hook() {}
+  intrusive_hook &operator=(const intrusive_hook &) noexcept { return *this; }
+
+  bool is_linked() const noexcept { return this->parent_ != nullptr; }
+
+private:
+  template <typename, typename> friend struct intrusive_tree;
+  using node = detail::node<detail::hook_value<Tag>>;
+
+  void reset() noexcept {
+    this->left_ = this->right_ = this->parent_ = nullptr;
+    this->size_ = 1;
+  }
+};
+
+template <typename T, typename Tag = void> struct intrusive_tree {
+  using value_type = T;
+  using hook_type = intrusive_hook<Tag>;
+
+  static_assert(std::is_base_of_v<hook_type, T>,
+    "the elements must derive from the hook for this tag");
+
+private:
+  using node = typename hook_type::node;
+
+  node sentinel_;
+
+  static hook_type &hook(node *p) { return static_cast<hook_type &>(*p); }
+
+  static T &object(node *p) { return static_cast<T &>(hook(p)); }
+
+  static node *node_of(const T &x) {
+    return const_cast<node *>(
+      static_cast<const node *>(static_cast<const hook_type *>(&x)));
+  }
+
+  template <bool Const> struct basic_iterator {
+  private:
+    friend struct intrusive_tree;
+    friend struct basic_iterator<!Const>;
+    node *p_;
+
+    explicit basic_iterator(node *p): p_(p) {}
+
+  public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = std::conditional_t<Const, const T *, T *>;
+    using reference = std::conditional_t<Const, const T &, T &>;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    // Singular value required for range iterator
+    basic_iterator(): p_(nullptr) {}
+
+    // Convert iterator to const_iterator
+    template <bool C>
+      requires(Const && !C)
+    basic_iterator(const basic_iterator<C> &other): p_(other.p_) {}
+
+    reference operator*() const { return object(p_); }
+    pointer operator->() const { return &object(p_); }
+
+    basic_iterator &operator++() {
+      p_ = inorder_successor(p_);
+      return *this;
+    }
+
+    basic_iterator operator++(int) {
+      basic_iterator result = *this;
+      ++*this;
+      return result;
+    }
+
+    basic_iterator &operator--() {
+      p_ = inorder_predecessor(p_);
+      return *this;
+    }
+
+    basic_iterator operator--(int) {
+      basic_iterator result = *this;
+      --*this;
+      return result;
+    }
+
+    template <bool C> bool operator==(const basic_iterator<C> &other) const {
+      return p_ == other.p_;
+    }
+  };
+
+  // The first element 'x' for which 'before(x)' is false
+  basic_iterator<false> bound(auto &&before) {
+    node *result = &sentinel_;
+    for (node *p = sentinel_.left_; p;) {
+      if (before(object(p))) {
+        p = p->right_;
+      } else {
+        result = p;
+        p = p->left_;
+      }
+    }
+    return basic_iterator<false>(result);
+  }
+
+public:
+  using iterator = basic_iterator<false>;
+  using const_iterator = basic_iterator<true>;
+
+  intrusive_tree() {
+    sentinel_.size_ = 0;
+    sentinel_.attach_root(nullptr);
+  }
+
+  intrusive_tree(intrusive_tree &&other) noexcept: intrusive_tree() {
+    sentinel_.attach_root(std::exchange(other.sentinel_.left_, nullptr));
+    other.sentinel_.attach_root(nullptr);
+  }
+
+  intrusive_tree &operator=(intrusive_tree &&other) noexcept {
+    if (this != &other) {
+      clear();
+      sentinel_.attach_root(std::exchange(other.sentinel_.left_, nullptr));
+      other.sentinel_.attach_root(nullptr);
+    }
+    return *this;
+  }
+
+  ~intrusive_tree() { clear(); }
+
+  iterator begin() { return iterator(sentinel_.right_); }
+  iterator end() { return iterator(&sentinel_); }
+  const_iterator begin() const { return const_iterator(sentinel_.right_); }
+  const_iterator end() const {
+    return const_iterator(const_cast<node *>(&sentinel_));
+  }
+
+  std::size_t size() const {
+    return sentinel_.left_ ? sentinel_.left_->size_ : 0;
+  }
+
+  bool empty() const { return !sentinel_.left_; }
+
+  // The iterator to 'x', which must be in this tree
+  iterator iterator_to(T &x) { return iterator(node_of(x)); }
+  const_iterator iterator_to(const T &x) const {
+    return const_iterator(node_of(x));
+  }
+
+  // Link 'x', which must not be in a tree, before 'position'
+  iterator insert(iterator position, T &x) {
+    node *p = node_of(x);
+    if (position.p_ == sentinel_.right_) { sentinel_.right_ = p; }
+    if (position.p_ == &sentinel_) { sentinel_.parent_ = p; }
+    return iterator(position.p_->insert_before_self(p));
+  }
+
+  // Unlink the element at 'position' and return an iterator to its
+  // successor; the element itself is untouched
+  iterator erase(iterator position) {
+    node *p = position.p_;
+    iterator result(inorder_successor(p));
+    if (p == sentinel_.right_) { sentinel_.right_ = result.p_; }
+    if (p == sentinel_.parent_) { sentinel_.parent_ = inorder_predecessor(p); }
+    p->unlink_self();
+    hook(p).reset();
+    return result;
+  }
+
+  // Unlink every element, in linear time
+  void clear() noexcept {
+    if (node *p = sentinel_.left_) {
+      sentinel_.attach_root(nullptr);
+      p->dispose_subtree([](node *q) { hook(q).reset(); });
+    }
+  }
+
+  void exchange_elements(iterator i, iterator j) {
+    sentinel_.exchange_in_tree(i.p_, j.p_);
+  }
+
+  iterator nth(std::size_t index) {
+    if (index < size()) {
+      return iterator(nth_node(sentinel_.left_, index));
+    } else {
+      return end();
+    }
+  }
+
+  std::size_t rank(const_iterator i) const { return rank_of(i.p_); }
+
+  bool valid() const {
+    return sentinel_.valid_tree();
+  }
+
+  // Return an iterator to the first element 'x' which satisfies
+  // 'cmp(x) >= 0', or 'end()' if there is none
+  template <typename Comp> iterator lower_bound(Comp &&cmp) {
+    return bound([&cmp](const T &x) { return cmp(x) < 0; });
+  }
+
+  // Return an iterator to the first element 'x' which satisfies
+  // 'cmp(x) > 0', or 'end()' if there is none
+  template <typename Comp> iterator upper_bound(Comp &&cmp) {
+    return bound([&cmp](const T &x) { return cmp(x) <= 0; });
+  }
+
+  template <typename Comp>
+  std::tuple<iterator, iterator> equal_range(Comp &&cmp) {
+    return std::make_tuple(lower_bound(cmp), upper_bound(cmp));
+  }
+
+  template <typename LComp, typename RComp>
+  std::tuple<iterator, iterator> range_between(LComp &&lcmp, RComp &&rcmp) {
+    return std::make_tuple(lower_bound(lcmp), upper_bound(rcmp));
+  }
+};
+
+}
@@ -1,37 +1,222 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <compare>
 #include <cstddef>
+#include <concepts>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <ratio>
 #include <tuple>
+#include <type_traits>
 #include <utility>
 
 namespace wb {
 
-template <typename T> struct tree;
+template <typename T, typename Allocator, typename Traits> struct tree;
+template <typename Tag> struct intrusive_hook;
+template <typename T, typename Tag> struct intrusive_tree;
+
+// The parameters of the weight balance [HiraiYamamoto2011], as exact
+// ratios. Counting a subtree of 'n' nodes as weighing 'n + 1', a node is
+// balanced when neither subtree weighs more than 'Delta' times the other,
+// and restoring the balance of a node takes a single rotation when the
+// inner child of its heavier subtree weighs less than 'Gamma' times the
+// outer child, or a double rotation otherwise. A larger 'Delta' allows
+// deeper trees but rotates less often. Only some pairs keep every node
+// balanced after each insertion and erasure, which is checked at compile
+// time: (3, 2) is the only pair of integers, and (5/2, 3/2), (4, 3/2) and
+// (13/4, 7/4) are among the others.
+template <typename Delta = std::ratio<3>, typename Gamma = std::ratio<2>>
+struct balance_policy {
+  using delta = typename Delta::type;
+  using gamma = typename Gamma::type;
+
+  // Whether a subtree of 'right' nodes weighs at most 'Delta' times its
+  // sibling of 'left' nodes
+  static constexpr bool is_balanced(std::size_t left, std::size_t right) {
+    return (std::size_t)delta::num * (left + 1) >=
+           (std::size_t)delta::den * (right + 1);
+  }
+
+  // Whether a single rotation rebalances a node whose heavier subtree has
+  // children of 'left' (inner) and 'right' (outer) nodes
+  static constexpr bool is_single(std::size_t left, std::size_t right) {
+    return (std::size_t)gamma::den * (left + 1) <
+           (std::size_t)gamma::num * (right + 1);
+  }
+
+private:
+  static constexpr bool balanced_weights(std::intmax_t a, std::intmax_t b) {
+    return delta::num * a >= delta::den * b && delta::num * b >= delta::den * a;
+  }
+
+  // Whether rebalancing restores the balance of every node after inserting
+  // or erasing one node. For heavy subtrees the rotations work exactly when
+  // '(Delta + 1) / Delta <= Gamma <= Delta - 1'; light subtrees have
+  // exceptions, which an exhaustive search over weights up to 16 finds.
+  static constexpr bool valid() {
+    using std::intmax_t;
+    if (delta::num < 2 * delta::den || gamma::num <= gamma::den ||
+        delta::num > 16 * delta::den || gamma::num > 16 * gamma::den) {
+      return false;
+    }
+    if ((delta::num + delta::den) * gamma::den > gamma::num * delta::num ||
+        gamma::num * delta::den > (delta::num - delta::den) * gamma::den) {
+      return false;
+    }
+    for (intmax_t w = 1; w != 16; ++w) {
+      for (intmax_t v = 1; delta::den * v <= delta::num * w; ++v) {
+        if (!balanced_weights(w, v)) { continue; }
+        // Erase from the light side, or insert into the heavy side
+        for (auto [l, r]: {std::pair(w - 1, v), std::pair(w, v + 1)}) {
+          if (!l || balanced_weights(l, r)) { continue; }
+          for (intmax_t x = 1; x != r; ++x) {
+            intmax_t y = r - x;
+            if (!balanced_weights(x, y)) { continue; }
+            if (gamma::den * x < gamma::num * y) {
+              if (!balanced_weights(l, x) || !balanced_weights(l + x, y)) {
+                return false;
+              }
+              continue;
+            }
+            for (intmax_t x1 = 1; x1 != x; ++x1) {
+              intmax_t x2 = x - x1;
+              if (balanced_weights(x1, x2) &&
+                  (!balanced_weights(l, x1) || !balanced_weights(x2, y) ||
+                    !balanced_weights(l + x1, x2 + y))) {
+                return false;
+              }
+            }
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  static_assert(valid(),
+    "these parameters do not keep a weight-balanced tree balanced");
+};
 
 namespace detail {
 
-template <typename T> struct node {
-  T value_;
-  std::size_t size_;
-  node<T> *left_;
-  node<T> *right_;
-  node<T> *parent_;
+// Counters updated by the rebalancing code of trees whose traits enable
+// statistics. A tree points 'current' at its own counters on entry to each
+// method that may rebalance, including the deferred rebalancing of const
+// methods and guards, and clears it when destroyed, so the counters need
+// no plumbing through the node functions; methods of one tree run on one
+// thread at a time.
+struct stats_counters {
+  std::size_t single_rotations{};
+  std::size_t double_rotations{};
+  std::size_t rebalances{};
+  std::size_t rebalance_nodes{};
+  std::size_t searches{};
+  std::size_t comparisons{};
+  std::size_t allocations{};
+  std::size_t deallocations{};
 
-  // Construct a singleton
-  template <typename U>
-  node(U &&value):
-      value_((U &&)value), size_(1), left_(nullptr), right_(nullptr),
-      parent_(nullptr) {}
+  static inline thread_local stats_counters *current{};
+};
+
+// Counters of trees whose traits disable statistics
+struct no_stats_counters {};
+
+// Hint that the cache line holding 'p' will be read soon
+inline void prefetch(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(p);
+#else
+  (void)p;
+#endif
+}
+
+// Return 'x', hiding from the optimizer how it was computed, so that the
+// compiler selects values by it with conditional moves rather than turning
+// the selection back into branches on the comparison that produced it
+inline bool opaque(bool x) {
+#if defined(__GNUC__) || defined(__clang__)
+  __asm__("" : "+r"(x));
+#endif
+  return x;
+}
+
+// A comparator returning a standard comparison category for a small,
+// trivially copyable 'T', such as 'x <=> a' for a number 'a', whose result
+// is cheap to compute and predicts poorly, so that a search does better to
+// select each child without branching
+template <typename Comp, typename T>
+concept three_way_comparator =
+  std::is_trivially_copyable_v<T> && sizeof(T) <= 2 * sizeof(void *) &&
+  requires(Comp &cmp, T &x) {
+    requires std::same_as<decltype(cmp(x)), std::strong_ordering> ||
+               std::same_as<decltype(cmp(x)), std::weak_ordering> ||
+               std::same_as<decltype(cmp(x)), std::partial_ordering>;
+  };
+
+// The summary stored in each node for the augmentation 'Augment', if any
+template <typename Augment> struct summary_of {
+  using type = typename Augment::value_type;
+};
+
+struct no_summary {};
+
+template <> struct summary_of<void> {
+  using type = no_summary;
+};
+
+// The links and size come before the value, so that they share a cache
+// line with whatever part of the value fits. 'SizeType' is the type of the
+// subtree sizes; with a 32-bit 'SizeType' and a 4-byte 'T' a node occupies
+// 32 bytes rather than 40 on a 64-bit target. 'Augment', unless it is
+// void, is an augmentation whose summary of each subtree follows the value
+// (see 'tree.hpp'). 'Balance' is a 'balance_policy'.
+template <typename T, typename SizeType = std::size_t,
+  bool CollectStats = false, typename Augment = void,
+  typename Balance = balance_policy<>>
+struct node {
+  using summary_type = typename summary_of<Augment>::type;
+  static constexpr bool augmented = !std::is_void_v<Augment>;
+
+  node *left_;
+  node *right_;
+  node *parent_;
+  SizeType size_;
+  [[no_unique_address]] T value_; // empty in the hooks of intrusive trees
+  [[no_unique_address]] summary_type summary_;
+
+  // Construct a singleton holding 'T(args...)'
+  template <typename... Args>
+  node(std::in_place_t, Args &&...args):
+      left_(nullptr), right_(nullptr), parent_(nullptr), size_(1),
+      value_((Args &&)args...), summary_(lift(value_)) {}
 
 private:
-  friend struct wb::tree<T>;
+  template <typename, typename, typename> friend struct wb::tree;
+  template <typename> friend struct wb::intrusive_hook;
+  template <typename, typename> friend struct wb::intrusive_tree;
   node() = default;
 
-  friend std::size_t size(const node<T> *s) { return s ? s->size_ : 0; }
+  // Worker threads of the parallel set operations have no counters
+  static void count(std::size_t stats_counters::*counter) {
+    if constexpr (CollectStats) {
+      if (stats_counters *stats = stats_counters::current) {
+        ++(stats->*counter);
+      }
+    }
+  }
+
+  friend std::size_t size(const node *s) { return s ? s->size_ : 0; }
 
-  friend bool is_sentinel(const node<T> *p) { return p->parent_ == p; }
+  // The sentinel is the only node of size zero. Its left link holds the
+  // root, and its right and parent links hold the first and last nodes in
+  // the sequence, or the sentinel itself if the sequence is empty.
+  friend bool is_sentinel(const node *p) { return !p->size_; }
 
-  friend node<T> *inorder_successor(node<T> *p) {
+  friend node *inorder_successor(node *p) {
     if (p->right_) {
       p = p->right_;
       while (p->left_) { p = p->left_; }
@@ -44,7 +229,7 @@ private:
     return p;
   }
 
-  friend const node<T> *inorder_successor(const node<T> *p) {
+  friend const node *inorder_successor(const node *p) {
     if (p->right_) {
       p = p->right_;
       while (p->left_) { p = p->left_; }
@@ -57,8 +242,10 @@ private:
     return p;
   }
 
-  friend node<T> *inorder_predecessor(node<T> *p) {
-    if (p->left_) {
+  friend node *inorder_predecessor(node *p) {
+    if (is_sentinel(p)) {
+      p = p->parent_;
+    } else if (p->left_) {
       p = p->left_;
       while (p->right_) { p = p->right_; }
     } else {
@@ -70,8 +257,10 @@ private:
     return p;
   }
 
-  friend const node<T> *inorder_predecessor(const node<T> *p) {
-    if (p->left_) {
+  friend const node *inorder_predecessor(const node *p) {
+    if (is_sentinel(p)) {
+      p = p->parent_;
+    } else if (p->left_) {
       p = p->left_;
       while (p->right_) { p = p->right_; }
     } else {
@@ -83,8 +272,8 @@ private:
     return p;
   }
 
-  friend node<T> *postorder_successor(node<T> *p) {
-    node<T> *q = p->parent_;
+  friend node *postorder_successor(node *p) {
+    node *q = p->parent_;
     if (p == q->left_) {
       if (q->right_) {
         q = q->right_;
@@ -94,46 +283,142 @@ private:
     return q;
   }
 
-  friend node<T> *&owner(node<T> *p) {
+  friend node *&owner(node *p) {
     return p->parent_->left_ == p ? p->parent_->left_ : p->parent_->right_;
   }
 
-  void recalculate_size() { size_ = size(left_) + size(right_) + 1; }
+  // The number of elements before 'p' in the sequence
+  friend std::size_t rank_of(const node *p) {
+    if (is_sentinel(p)) { return size(p->left_); }
+    std::size_t result = size(p->left_);
+    while (!is_sentinel(p->parent_)) {
+      if (p == p->parent_->right_) { result += size(p->parent_->left_) + 1; }
+      p = p->parent_;
+    }
+    return result;
+  }
 
-  bool is_balanced(node<T> *left, node<T> *right) {
-    return 3 * (size(left) + 1) >= size(right) + 1;
-    return true;
+  // The node at index 'index' in the subtree 'p', which must exist
+  friend node *nth_node(node *p, std::size_t index) {
+    while (true) {
+      std::size_t left_size = size(p->left_);
+      if (index < left_size) {
+        p = p->left_;
+      } else if (index > left_size) {
+        index -= left_size + 1;
+        p = p->right_;
+      } else {
+        return p;
+      }
+    }
   }
 
-  bool is_single(node<T> *left, node<T> *right) {
-    return size(left) + 1 <= 2 * (size(right) + 1);
-    return true;
+  // The node 'n' places after 'p' (or before, if 'n' is negative), which
+  // may be the sentinel; climbs only as far as the target's subtree
+  friend const node *advance_node(const node *p, std::ptrdiff_t n) {
+    if (!n) { return p; }
+    const node *top = p;
+    std::size_t index;
+    if (is_sentinel(p)) {
+      top = p->left_;
+      index = size(top);
+    } else {
+      index = size(p->left_);
+      while (!is_sentinel(top->parent_) &&
+             (n < 0 ? index < (std::size_t)-n : index + n >= top->size_)) {
+        if (top == top->parent_->right_) {
+          index += size(top->parent_->left_) + 1;
+        }
+        top = top->parent_;
+      }
+    }
+    index += n;
+    if (index == top->size_) { return top->parent_; }
+    return nth_node(const_cast<node *>(top), index);
+  }
+
+  static summary_type lift(const T &value) {
+    if constexpr (augmented) {
+      return Augment::lift(value);
+    } else {
+      return {};
+    }
+  }
+
+  // The summary of this subtree, from this node's value and its children's
+  // summaries
+  summary_type combined_summary() const {
+    summary_type s = Augment::lift(value_);
+    if (left_) { s = Augment::combine(left_->summary_, s); }
+    if (right_) { s = Augment::combine(s, right_->summary_); }
+    return s;
+  }
+
+  void recalculate_summary() {
+    if constexpr (augmented) { summary_ = combined_summary(); }
+  }
+
+  // Recalculate this node's size and summary from its children's
+  void recalculate() {
+    size_ = size(left_) + size(right_) + 1;
+    recalculate_summary();
+  }
+
+  // Recalculate the summaries of this node and its ancestors
+  void recalculate_summaries_above() {
+    if constexpr (augmented) {
+      for (node *p = this; !is_sentinel(p); p = p->parent_) {
+        p->recalculate_summary();
+      }
+    }
+  }
+
+  // The summary of the elements at indices '[i, j)' of the subtree 'p',
+  // where 'i < j <= size(p)'; this visits two paths from 'p'
+  static summary_type summarize(const node *p, std::size_t i, std::size_t j) {
+    if (i == 0 && j == p->size_) { return p->summary_; }
+    std::size_t l = size(p->left_);
+    if (j <= l) { return summarize(p->left_, i, j); }
+    if (i > l) { return summarize(p->right_, i - l - 1, j - l - 1); }
+    summary_type s = Augment::lift(p->value_);
+    if (i < l) { s = Augment::combine(summarize(p->left_, i, l), s); }
+    if (j > l + 1) {
+      s = Augment::combine(s, summarize(p->right_, 0, j - l - 1));
+    }
+    return s;
+  }
+
+  static bool is_balanced(node *left, node *right) {
+    return Balance::is_balanced(size(left), size(right));
+  }
+
+  static bool is_single(node *left, node *right) {
+    return Balance::is_single(size(left), size(right));
   }
 
   // Returns the subtree
-  node<T> *balance_left() {
+  node *balance_left() {
     if (!is_balanced(left_, right_)) {
       if (is_single(right_->left_, right_->right_)) {
-        node<T> *a = this;
-        node<T> *b = a->right_;
-        node<T> *c = b->left_;
-        owner(a) = b;
-        b->parent_ = a->parent_;
+        node *a = this;
+        node *b = a->right_;
+        node *c = b->left_;
+        a->replace_self(b);
         a->right_ = c;
         if (c) { c->parent_ = a; }
         b->left_ = a;
         a->parent_ = b;
-        recalculate_size();
-        b->recalculate_size();
+        count(&stats_counters::single_rotations);
+        recalculate();
+        b->recalculate();
         return b;
       } else {
-        node<T> *a = this;
-        node<T> *b = a->right_;
-        node<T> *c = b->left_;
-        node<T> *d = c->left_;
-        node<T> *e = c->right_;
-        owner(a) = c;
-        c->parent_ = a->parent_;
+        node *a = this;
+        node *b = a->right_;
+        node *c = b->left_;
+        node *d = c->left_;
+        node *e = c->right_;
+        a->replace_self(c);
         a->right_ = d;
         if (d) { d->parent_ = a; }
         b->left_ = e;
@@ -142,9 +427,10 @@ private:
         a->parent_ = c;
         c->right_ = b;
         b->parent_ = c;
-        a->recalculate_size();
-        b->recalculate_size();
-        c->recalculate_size();
+        count(&stats_counters::double_rotations);
+        a->recalculate();
+        b->recalculate();
+        c->recalculate();
         return c;
       }
     } else {
@@ -153,29 +439,28 @@ private:
   }
 
   // Returns the subtree
-  node<T> *balance_right() {
+  node *balance_right() {
     if (!is_balanced(right_, left_)) {
       if (is_single(left_->right_, left_->left_)) {
-        node<T> *a = this;
-        node<T> *b = a->left_;
-        node<T> *c = b->right_;
-        owner(a) = b;
-        b->parent_ = a->parent_;
+        node *a = this;
+        node *b = a->left_;
+        node *c = b->right_;
+        a->replace_self(b);
         a->left_ = c;
         if (c) { c->parent_ = a; }
         b->right_ = a;
         a->parent_ = b;
-        recalculate_size();
-        b->recalculate_size();
+        count(&stats_counters::single_rotations);
+        recalculate();
+        b->recalculate();
         return b;
       } else {
-        node<T> *a = this;
-        node<T> *b = a->left_;
-        node<T> *c = b->right_;
-        node<T> *d = c->right_;
-        node<T> *e = c->left_;
-        owner(a) = c;
-        c->parent_ = a->parent_;
+        node *a = this;
+        node *b = a->left_;
+        node *c = b->right_;
+        node *d = c->right_;
+        node *e = c->left_;
+        a->replace_self(c);
         a->left_ = d;
         if (d) { d->parent_ = a; }
         b->right_ = e;
@@ -184,9 +469,10 @@ private:
         a->parent_ = c;
         c->left_ = b;
         b->parent_ = c;
-        a->recalculate_size();
-        b->recalculate_size();
-        c->recalculate_size();
+        count(&stats_counters::double_rotations);
+        a->recalculate();
+        b->recalculate();
+        c->recalculate();
         return c;
       }
     } else {
@@ -195,11 +481,14 @@ private:
   }
 
   void balance_above(int increment) {
-    node<T> *p = this;
+    node *p = this;
+    count(&stats_counters::rebalances);
     while (!is_sentinel(p->parent_)) {
       bool is_right = p == p->parent_->right_;
       p = p->parent_;
+      count(&stats_counters::rebalance_nodes);
       p->size_ += increment;
+      p->recalculate_summary();
       if (is_right == (increment > 0)) {
         p = p->balance_left();
       } else {
@@ -208,10 +497,27 @@ private:
     }
   }
 
-  template <typename U> node<T> *insert_before_self(U &&value) {
-    node<T> *result = new node<T>((U &&)value);
+  // Build a perfectly balanced subtree from the next 'n' nodes returned by
+  // 'next', in order. The parent of the returned root is left unset.
+  static node *build_subtree(std::size_t n, auto &&next) {
+    if (!n) { return nullptr; }
+    node *left = build_subtree((n - 1) / 2, next);
+    node *p = next();
+    node *right = build_subtree(n / 2, next);
+    p->left_ = left;
+    p->right_ = right;
+    p->size_ = n;
+    p->recalculate_summary();
+    if (left) { left->parent_ = p; }
+    if (right) { right->parent_ = p; }
+    return p;
+  }
+
+  // Link the singleton 'result' as a leaf just before this node, leaving
+  // the sizes above it to the caller
+  void link_before_self(node *result) {
     if (left_) {
-      node<T> *p = left_;
+      node *p = left_;
       while (p->right_) { p = p->right_; }
       p->right_ = result;
       result->parent_ = p;
@@ -219,36 +525,105 @@ private:
       left_ = result;
       result->parent_ = this;
     }
+  }
+
+  // Link the singleton 'result' into the sequence just before this node
+  node *insert_before_self(node *result) {
+    link_before_self(result);
     result->balance_above(1);
     return result;
   }
 
-  void replace_self(node<T> *p) {
-    owner(this) = p;
+  // The top bit of a size marks a node linked under a 'deferred_balance'
+  // guard, whose size is otherwise meaningless. Pending nodes are linked as
+  // leaves, so every node below a pending node is pending too, and the
+  // sizes and summaries of the older nodes are left as they were,
+  // describing the tree without the pending nodes.
+  static constexpr SizeType pending_bit = (SizeType)(
+    SizeType{1} << (std::numeric_limits<SizeType>::digits - 1));
+
+  friend bool is_pending(const node *p) { return p->size_ & pending_bit; }
+
+  // The number of older nodes before the root 'p' of a pending subtree
+  // hanging from an older node; the pending subtrees elsewhere count as
+  // empty
+  friend std::size_t older_rank(const node *p) {
+    std::size_t result = 0;
+    for (; !is_sentinel(p->parent_); p = p->parent_) {
+      const node *sibling = p->parent_->left_;
+      if (p != sibling) {
+        result += (sibling && !is_pending(sibling) ? sibling->size_ : 0) + 1;
+      }
+    }
+    return result;
+  }
+
+  // Rebuild the detached subtree 'p' as a perfectly balanced subtree of the
+  // same nodes, which keep their order, and return its new root. The
+  // subtree is first flattened, by right rotations, into a list chained
+  // through the right links, so that a pending chain of any length needs
+  // no recursion.
+  static node *rebuild_subtree(node *p) {
+    return rebuild_subtree(p, [](node *) { return true; });
+  }
+
+  // The same, keeping only the nodes 'q' for which 'keep(q)' is true;
+  // 'keep' takes over the others, which are already unlinked
+  static node *rebuild_subtree(node *p, auto &&keep) {
+    node *head = nullptr;
+    node **tail = &head;
+    std::size_t n = 0;
+    while (p) {
+      if (node *q = p->left_) {
+        p->left_ = q->right_;
+        q->right_ = p;
+        p = q;
+      } else if (node *next = p->right_; keep(p)) {
+        *tail = p;
+        tail = &p->right_;
+        p = next;
+        ++n;
+      } else {
+        p = next;
+      }
+    }
+    return build_subtree(n, [&head] {
+      node *q = head;
+      head = q->right_;
+      return q;
+    });
+  }
+
+  // Put 'p' in place of this node under its parent, which may be null if
+  // this node is the root of a detached subtree
+  void replace_self(node *p) {
+    if (parent_) { owner(this) = p; }
     if (p) { p->parent_ = parent_; }
   }
 
-  void erase_self() {
+  // Unlink this node from the sequence, leaving it to the caller to destroy
+  void unlink_self() {
     if (!left_ || !right_) {
-      --parent_->size_;
-      node<T> *p = !left_ ? right_ : left_;
+      node *p = !left_ ? right_ : left_;
       if (p) { p->parent_ = parent_; }
-      if (this == parent_->left_) {
+      if (is_sentinel(parent_)) {
         parent_->left_ = p;
-        if (!is_sentinel(parent_)) {
+      } else {
+        if (this == parent_->left_) {
+          parent_->left_ = p;
+          parent_->recalculate();
           p = parent_->balance_left();
-          p->balance_above(-1);
+        } else {
+          parent_->right_ = p;
+          parent_->recalculate();
+          p = parent_->balance_right();
         }
-      } else {
-        parent_->right_ = p;
-        p = parent_->balance_right();
         p->balance_above(-1);
       }
-      delete this;
     } else {
-      node<T> *p = inorder_successor(this);
+      node *p = inorder_successor(this);
       if (p != right_) {
-        node<T> *q = p->parent_;
+        node *q = p->parent_;
         q->left_ = p->right_;
         if (p->right_) { p->right_->parent_ = q; }
         p->right_ = right_;
@@ -257,23 +632,105 @@ private:
         left_->parent_ = p;
         replace_self(p);
         p->size_ = size_;
-        --q->size_;
+        q->recalculate();
         q = q->balance_left();
         q->balance_above(-1);
-        delete this;
       } else {
         replace_self(p);
         p->left_ = left_;
         left_->parent_ = p;
-        p->size_ = size_ - 1;
+        p->recalculate();
         p = p->balance_right();
         p->balance_above(-1);
-        delete this;
       }
     }
   }
 
-  friend void exchange_nodes(node<T> *p, node<T> *q) {
+  // The remaining static functions operate on detached subtrees, whose
+  // roots' parent links are ignored on entry and null on exit
+
+  // Join 'left', the singleton 'k' and 'right', in that order
+  static node *join_subtrees(node *left, node *k, node *right) {
+    if (!is_balanced(left, right)) {
+      node *p = join_subtrees(left, k, right->left_);
+      right->left_ = p;
+      p->parent_ = right;
+      right->parent_ = nullptr;
+      right->recalculate();
+      return right->balance_right();
+    } else if (!is_balanced(right, left)) {
+      node *p = join_subtrees(left->right_, k, right);
+      left->right_ = p;
+      p->parent_ = left;
+      left->parent_ = nullptr;
+      left->recalculate();
+      return left->balance_left();
+    } else {
+      k->left_ = left;
+      k->right_ = right;
+      k->parent_ = nullptr;
+      if (left) { left->parent_ = k; }
+      if (right) { right->parent_ = k; }
+      k->recalculate();
+      return k;
+    }
+  }
+
+  // Split off the first 'count' nodes of the subtree 'p'
+  static std::tuple<node *, node *> split_subtree(
+    node *p, std::size_t count) {
+    if (!p) { return std::make_tuple(nullptr, nullptr); }
+    node *left = p->left_;
+    node *right = p->right_;
+    if (count <= size(left)) {
+      auto [l, r] = split_subtree(left, count);
+      return std::make_tuple(l, join_subtrees(r, p, right));
+    } else {
+      auto [l, r] = split_subtree(right, count - size(left) - 1);
+      return std::make_tuple(join_subtrees(left, p, l), r);
+    }
+  }
+
+  // Join 'left' and 'right', in that order
+  static node *join_subtrees(node *left, node *right) {
+    if (!left || !right) {
+      node *p = left ? left : right;
+      if (p) { p->parent_ = nullptr; }
+      return p;
+    }
+    auto [k, r] = split_subtree(right, 1);
+    return join_subtrees(left, k, r);
+  }
+
+  // The number of nodes 'x' in the subtree 'p' for which 'before(x)' holds,
+  // assuming that those nodes come first
+  static std::size_t partition_rank(const node *p, auto &&before) {
+    std::size_t count{};
+    while (p) {
+      if (before(p->value_)) {
+        count += size(p->left_) + 1;
+        p = p->right_;
+      } else {
+        p = p->left_;
+      }
+    }
+    return count;
+  }
+
+  // Check sizes, parent links and balance, for testing
+  static bool valid_subtree(const node *p, const node *parent) {
+    if (!p) { return true; }
+    if constexpr (augmented && std::equality_comparable<summary_type>) {
+      if (!(p->combined_summary() == p->summary_)) { return false; }
+    }
+    return p->parent_ == parent &&
+           p->size_ == size(p->left_) + size(p->right_) + 1 &&
+           is_balanced(p->left_, p->right_) &&
+           is_balanced(p->right_, p->left_) &&
+           valid_subtree(p->left_, p) && valid_subtree(p->right_, p);
+  }
+
+  friend void exchange_nodes(node *p, node *q) {
     std::swap(p->size_, q->size_);
     if (p->parent_ == q) { std::swap(p, q); }
 
@@ -306,60 +763,205 @@ private:
       if (q->left_) { q->left_->parent_ = q; }
       if (q->right_) { q->right_->parent_ = q; }
     }
+    // The values have moved, so the summaries above both have changed
+    p->recalculate_summaries_above();
+    q->recalculate_summaries_above();
+  }
+
+  // Make the detached subtree 'p', which may be null, the tree of this
+  // sentinel, caching its first and last nodes
+  void attach_root(node *p) {
+    left_ = p;
+    right_ = this;
+    parent_ = this;
+    if (p) {
+      p->parent_ = this;
+      node *q = p;
+      while (q->left_) { q = q->left_; }
+      right_ = q;
+      while (p->right_) { p = p->right_; }
+      parent_ = p;
+    }
+  }
+
+  // Exchange the nodes 'p' and 'q' of this sentinel's tree, keeping its
+  // cached first and last nodes
+  void exchange_in_tree(node *p, node *q) {
+    auto relocate = [p, q](node *&end) {
+      if (end == p) {
+        end = q;
+      } else if (end == q) {
+        end = p;
+      }
+    };
+    relocate(right_);
+    relocate(parent_);
+    exchange_nodes(p, q);
+  }
+
+  // Check this sentinel's cached first and last nodes and its tree, for
+  // testing
+  bool valid_tree() const {
+    const node *first = this, *last = this;
+    if (const node *p = left_) {
+      for (first = p; first->left_; first = first->left_) {}
+      for (last = p; last->right_; last = last->right_) {}
+    }
+    return right_ == first && parent_ == last && valid_subtree(left_, this);
   }
 
-  void delete_subtree() {
-    node<T> *p = this;
-    while (p->left_) { p = p->left_; }
+  // Reverse the sequence of the detached subtree 'p' by exchanging the
+  // children of each node. Weight balance is symmetric, so the mirrored
+  // subtree is as balanced as before and needs no rotations.
+  static void mirror_subtree(node *p) {
+    if constexpr (augmented) {
+      // The summaries are recalculated children first
+      if (!p) { return; }
+      std::swap(p->left_, p->right_);
+      mirror_subtree(p->left_);
+      mirror_subtree(p->right_);
+      p->recalculate_summary();
+    } else {
+      // Recurse on one side and iterate on the other
+      for (; p; p = p->right_) {
+        std::swap(p->left_, p->right_);
+        if (p->right_) { prefetch(p->right_); }
+        mirror_subtree(p->left_);
+      }
+    }
+  }
+
+  // Call 'dispose' on each node of the subtree, children before parents
+  void dispose_subtree(auto &&dispose) {
+    node *p = this;
+    while (p->left_ || p->right_) { p = (p->left_ ? p->left_ : p->right_); }
     while (p != this) {
-      node<T> *q = postorder_successor(p);
-      delete p;
+      node *q = postorder_successor(p);
+      dispose(p);
       p = q;
     }
-    delete this;
+    dispose(this);
   }
 
-  friend node<T> *lower_bound_node(node<T> *p, auto &&cmp) {
-    while (true) {
-      if (cmp(p->value_) < 0) {
-        if (p->right_) {
-          p = p->right_;
-        } else {
-          p = inorder_successor(p);
-          break;
-        }
-      } else {
-        if (p->left_) {
-          p = p->left_;
+  // The first node 'x' of the subtree 'p' for which 'before(x)' is false,
+  // or the successor of the subtree if there is none. The next node is
+  // selected by conditional moves rather than a branch, and both children
+  // are prefetched while 'before' is evaluated, so that a search of a tree
+  // larger than the cache overlaps each level's miss with the comparison
+  // above it.
+  friend node *branchless_bound_node(node *p, auto &&before) {
+    node *result = nullptr;
+    node *last;
+    do {
+      prefetch(p->left_);
+      prefetch(p->right_);
+      bool right = opaque(before(p->value_));
+      last = p;
+      result = right ? result : p;
+      p = right ? p->right_ : p->left_;
+    } while (p);
+    return result ? result : inorder_successor(last);
+  }
+
+  friend node *lower_bound_node(node *p, auto &&cmp) {
+    if constexpr (three_way_comparator<decltype(cmp), T>) {
+      return branchless_bound_node(
+        p, [&cmp](T &x) { return cmp(x) < 0; });
+    } else {
+      while (true) {
+        if (cmp(p->value_) < 0) {
+          if (p->right_) {
+            p = p->right_;
+          } else {
+            p = inorder_successor(p);
+            break;
+          }
         } else {
-          break;
+          if (p->left_) {
+            p = p->left_;
+          } else {
+            break;
+          }
         }
       }
+      return p;
     }
-    return p;
   }
 
-  friend node<T> *upper_bound_node(node<T> *p, auto &&cmp) {
+  // Return the first node 'x' at or after the sequence start for which
+  // 'before(x)' is false, searching outwards from 'hint' (which may be the
+  // sentinel): climb until the subtree brackets the answer, then descend,
+  // making a number of calls logarithmic in the distance to the answer
+  friend node *finger_bound_node(node *hint, auto &&before) {
+    node *p = hint;
+    if (is_sentinel(p)) {
+      if (!p->left_) { return p; }
+      p = p->parent_;
+    }
+    if (before(p->value_)) {
+      // The answer follows 'p'; climb while the successor of the subtree
+      // at 'p' is also before the answer
+      while (!is_sentinel(p->parent_)) {
+        node *q = p->parent_;
+        if (q->left_ == p && !before(q->value_)) { break; }
+        p = q;
+      }
+      if (!p->right_) { return inorder_successor(p); }
+      p = p->right_;
+    } else {
+      // The answer is 'p' or precedes it; climb while the predecessor of
+      // the subtree at 'p' is not before the answer
+      while (!is_sentinel(p->parent_)) {
+        node *q = p->parent_;
+        if (q->right_ == p && before(q->value_)) { break; }
+        p = q;
+      }
+      if (!p->left_) { return p; }
+      p = p->left_;
+    }
     while (true) {
-      if (cmp(p->value_) <= 0) {
+      if (before(p->value_)) {
         if (p->right_) {
           p = p->right_;
         } else {
-          p = inorder_successor(p);
-          break;
+          return inorder_successor(p);
         }
       } else {
         if (p->left_) {
           p = p->left_;
         } else {
-          break;
+          return p;
         }
       }
     }
-    return p;
   }
 
-  friend auto equal_range_nodes(node<T> *p, auto &&cmp) {
+  friend node *upper_bound_node(node *p, auto &&cmp) {
+    if constexpr (three_way_comparator<decltype(cmp), T>) {
+      return branchless_bound_node(
+        p, [&cmp](T &x) { return cmp(x) <= 0; });
+    } else {
+      while (true) {
+        if (cmp(p->value_) <= 0) {
+          if (p->right_) {
+            p = p->right_;
+          } else {
+            p = inorder_successor(p);
+            break;
+          }
+        } else {
+          if (p->left_) {
+            p = p->left_;
+          } else {
+            break;
+          }
+        }
+      }
+      return p;
+    }
+  }
+
+  friend auto equal_range_nodes(node *p, auto &&cmp) {
     while (true) {
       auto cmp_result = cmp(p->value_);
       if (cmp_result < 0) {
@@ -384,7 +986,50 @@ private:
     return std::make_tuple(p, p);
   }
 
-  friend auto range_between_nodes(node<T> *p, auto &&lcmp, auto &&rcmp) {
+  // Batched lower bounds: for each comparator in the query range '[first,
+  // last)', in order, call 'emit' with the lower bound of that comparator
+  // within the subtree 'p' (which may be null), or 'after' if there is none.
+  // The queries must be ordered by their results. At each node the batch is
+  // divided by binary search, and each half continues down one side only.
+  friend void lower_bounds_nodes(
+    node *p, node *after, auto first, auto last, auto &&emit) {
+    while (first != last) {
+      if (!p) {
+        for (; first != last; ++first) { emit(after); }
+        return;
+      }
+      auto mid = std::ranges::partition_point(
+        first, last, [p](auto &&cmp) { return cmp(p->value_) >= 0; });
+      lower_bounds_nodes(p->left_, p, first, mid, emit);
+      first = mid;
+      p = p->right_;
+    }
+  }
+
+  // Batched equal ranges: as 'lower_bounds_nodes', but calling 'emit' with
+  // the lower and upper bounds of each comparator. Queries whose ranges
+  // contain 'p' finish with single searches on each side, as in
+  // 'equal_range_nodes'.
+  friend void equal_ranges_nodes(
+    node *p, node *after, auto first, auto last, auto &&emit) {
+    while (first != last) {
+      if (!p) {
+        for (; first != last; ++first) { emit(after, after); }
+        return;
+      }
+      auto mid = std::ranges::partition_point(
+        first, last, [p](auto &&cmp) { return cmp(p->value_) > 0; });
+      equal_ranges_nodes(p->left_, p, first, mid, emit);
+      for (first = mid; first != last && (*first)(p->value_) == 0; ++first) {
+        auto l = p->left_ ? lower_bound_node(p->left_, *first) : p;
+        auto r = p->right_ ? upper_bound_node(p->right_, *first) : after;
+        emit(l, r);
+      }
+      p = p->right_;
+    }
+  }
+
+  friend auto range_between_nodes(node *p, auto &&lcmp, auto &&rcmp) {
     while (true) {
       if (lcmp(p->value_) < 0) {
         if (p->right_) {
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "execution.hpp"
+#include "tree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Parallel visits of the elements of a 'wb::tree'.
+
+// 'parallel_for_each(policy, tree, f)' calls 'f(x)' for each element 'x' of
+// the tree, and 'parallel_for_each(policy, tree, first, last, f)' for each
+// element in '[first, last)'. Under a parallel policy (see 'execution.hpp')
+// the range is divided by rank into chunks of about equal size, each found
+// from the subtree sizes in logarithmic time, which run concurrently, so
+// 'f' must be safe to call from several threads at once. Each chunk is
+// visited in order by 'tree::for_each'. If 'f' throws, chunks not yet
+// started are skipped and the exception is rethrown once the running
+// chunks finish.
+
+namespace wb {
+
+namespace detail {
+
+// Call 'task(i)' for each 'i' in '[0, count)', on up to 'threads' threads
+// including the calling thread. If a task throws, the tasks not yet started
+// are skipped, and the first exception is rethrown on the calling thread
+// once every thread has finished.
+template <typename F>
+void run_tasks(unsigned threads, std::size_t count, F &&task) {
+  std::atomic<std::size_t> next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto work = [&] {
+    for (std::size_t i; (i = next++) < count;) {
+      try {
+        task(i);
+      } catch (...) {
+        std::lock_guard lock(error_mutex);
+        if (!error) { error = std::current_exception(); }
+        next = count;
+      }
+    }
+  };
+  {
+    std::vector<std::jthread> workers;
+    std::size_t helpers = (std::min)((std::size_t)threads, count);
+    for (std::size_t t = 1; t < helpers; ++t) { workers.emplace_back(work); }
+    work();
+  }
+  if (error) { std::rethrow_exception(error); }
+}
+
+// Call 'f' on each element of '[first, last)' of 't', which may be const,
+// in chunks run under 'policy'
+template <typename Policy, typename Tree, typename I, typename F>
+void for_each_chunk(const Policy &policy, Tree &t, I first, I last, F &f) {
+  std::size_t i = t.rank(first);
+  std::size_t n = t.rank(last) - i;
+  std::size_t chunks = chunk_count(policy, n);
+  if (chunks == 1) {
+    t.for_each(first, last, std::ref(f));
+  } else {
+    run_tasks(thread_count(policy), chunks, [&](std::size_t c) {
+      t.for_each(t.nth(i + c * n / chunks), t.nth(i + (c + 1) * n / chunks),
+        std::ref(f));
+    });
+  }
+}
+
+}
+
+template <execution_policy Policy, typename T, typename Allocator,
+  typename Traits, typename F>
+void parallel_for_each(const Policy &policy, tree<T, Allocator, Traits> &t,
+  typename tree<T, Allocator, Traits>::iterator first,
+  typename tree<T, Allocator, Traits>::iterator last, F f) {
+  detail::for_each_chunk(policy, t, first, last, f);
+}
+
+template <execution_policy Policy, typename T, typename Allocator,
+  typename Traits, typename F>
+void parallel_for_each(
+  const Policy &policy, tree<T, Allocator, Traits> &t, F f) {
+  detail::for_each_chunk(policy, t, t.begin(), t.end(), f);
+}
+
+template <execution_policy Policy, typename T, typename Allocator,
+  typename Traits, typename F>
+void parallel_for_each(const Policy &policy,
+  const tree<T, Allocator, Traits> &t,
+  typename tree<T, Allocator, Traits>::const_iterator first,
+  typename tree<T, Allocator, Traits>::const_iterator last, F f) {
+  detail::for_each_chunk(policy, t, first, last, f);
+}
+
+template <execution_policy Policy, typename T, typename Allocator,
+  typename Traits, typename F>
+void parallel_for_each(
+  const Policy &policy, const tree<T, Allocator, Traits> &t, F f) {
+  detail::for_each_chunk(policy, t, t.begin(), t.end(), f);
+}
+
+}
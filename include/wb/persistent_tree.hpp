@@ -0,0 +1,612 @@
+#pragma once
+
+#include "node.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <compare>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A persistent variant of 'wb::tree' whose copies share structure.
+
+// The class template 'persistent_tree' represents a sequence of values
+// allowing binary search with arbitrary comparators, like 'wb::tree', but
+// copying it, or calling 'snapshot()', takes constant time: the copy shares
+// every node with the original. Nodes are reference counted and immutable
+// while shared; 'insert' and 'erase' copy the O(log n) shared nodes they
+// would modify (path copying), and modify unshared nodes in place, so a
+// tree that has no live snapshots pays for no copies. A node is destroyed
+// when the last tree referring to it releases it.
+
+// The nodes have no parent links, since a shared node has many parents, so
+// iterators hold the path from the root to the element they point to.
+// Iteration takes amortized constant time per step, but an iterator is
+// large: it holds room for the deepest path of a balanced tree. Iterators
+// are constant, and any modification of a tree invalidates the iterators
+// into that tree (but not into its snapshots).
+
+// The balance criteria are those of 'wb::tree', set by the 'Balance'
+// parameter, a 'wb::balance_policy'.
+
+// Distinct trees may be used concurrently from different threads even when
+// they share nodes, and in particular a writer thread may modify a tree
+// while reader threads search its snapshots; a single tree may not be
+// modified concurrently with any other use of it. The reference counts are
+// atomic, but nodes are deallocated by whichever thread drops the last
+// reference, so the allocator must be safe to use from each thread that
+// destroys a snapshot (which 'wb::pool_allocator' is not).
+
+// The class template 'persistent_tree' provides the following methods:
+//   persistent_tree(); // default constructor
+//   explicit persistent_tree(const Allocator &alloc);
+//   persistent_tree(first, last, alloc = Allocator());
+//   persistent_tree(const persistent_tree &other); // constant time
+//   persistent_tree(persistent_tree &&other);
+//   persistent_tree &operator=(const persistent_tree &other);
+//   persistent_tree &operator=(persistent_tree &&other);
+//   ~persistent_tree();
+//   persistent_tree snapshot() const; // a copy, in constant time
+//   allocator_type get_allocator() const;
+//   const_iterator begin() const;
+//   const_iterator end() const;
+//   std::size_t size() const;
+//   bool empty() const;
+//   const_iterator nth(std::size_t index) const;
+//   std::size_t rank(const_iterator i) const;
+//   const_iterator insert(const_iterator position, value);
+//   const_iterator erase(const_iterator position);
+//   const_iterator lower_bound(cmp) const;
+//   const_iterator upper_bound(cmp) const;
+//   std::tuple<const_iterator, const_iterator> equal_range(cmp) const;
+//   std::tuple<const_iterator, const_iterator> range_between(
+//     lcmp, rcmp) const;
+//   bool valid() const; // check structural invariants, for testing
+// with the same meanings as for 'wb::tree'.
+
+// If copying a value or allocating a node throws during 'insert' or
+// 'erase' before the sequence is changed, the tree is unchanged. If it
+// throws while copying nodes to rotate them afterwards, the modification
+// is completed, skipping those rotations, before the exception propagates,
+// so that part of the tree may be left out of balance. Such a tree stays
+// usable: its searches may take longer, and an iterator whose path is
+// deeper than a balanced tree allows keeps the rest of it on the heap.
+
+namespace wb {
+
+namespace detail {
+
+template <typename T, typename SizeType, typename Balance>
+struct persistent_node {
+  persistent_node *left_;
+  persistent_node *right_;
+  SizeType size_;
+  std::atomic<std::size_t> references_;
+  T value_;
+
+  template <typename U>
+  persistent_node(U &&value):
+      left_(nullptr), right_(nullptr), size_(1), references_(1),
+      value_((U &&)value) {}
+
+  static std::size_t size(const persistent_node *p) {
+    return p ? p->size_ : 0;
+  }
+
+  void recalculate_size() { size_ = size(left_) + size(right_) + 1; }
+
+  static constexpr bool is_balanced(std::size_t left, std::size_t right) {
+    return Balance::is_balanced(left, right);
+  }
+
+  static constexpr bool is_single(std::size_t left, std::size_t right) {
+    return Balance::is_single(left, right);
+  }
+};
+
+}
+
+template <typename T, typename Allocator = std::allocator<T>,
+  typename Balance = balance_policy<>>
+struct persistent_tree {
+  using allocator_type = Allocator;
+
+private:
+  using node = detail::persistent_node<T,
+    typename std::allocator_traits<Allocator>::size_type, Balance>;
+  using node_allocator_type = typename std::allocator_traits<
+    Allocator>::template rebind_alloc<node>;
+  using node_traits = std::allocator_traits<node_allocator_type>;
+
+  // A bound on the depth of a node in a balanced tree: a subtree weighs at
+  // most 2^digits and at least 2, and each child weighs at most
+  // 'Delta / (Delta + 1)' as much as its parent
+  static constexpr std::size_t max_height = [] {
+    using delta = typename Balance::delta;
+    double weight = 1;
+    for (int i = 0;
+         i != std::numeric_limits<typename node_traits::size_type>::digits; ++i) {
+      weight *= 2;
+    }
+    std::size_t height = 2;
+    for (; weight >= 1; ++height) {
+      weight = weight * (double)delta::num / (double)(delta::num + delta::den);
+    }
+    return height;
+  }();
+
+  node *root_;
+  [[no_unique_address]] node_allocator_type alloc_;
+
+  template <typename U> node *create_node(U &&value) {
+    node *p = node_traits::allocate(alloc_, 1);
+    try {
+      node_traits::construct(alloc_, p, (U &&)value);
+    } catch (...) {
+      node_traits::deallocate(alloc_, p, 1);
+      throw;
+    }
+    return p;
+  }
+
+  static node *acquire(node *p) {
+    if (p) { p->references_.fetch_add(1, std::memory_order_relaxed); }
+    return p;
+  }
+
+  // Drop a reference, destroying the subtree's unshared nodes
+  void release(node *p) {
+    while (p && p->references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      node *left = p->left_, *right = p->right_;
+      node_traits::destroy(alloc_, p);
+      node_traits::deallocate(alloc_, p, 1);
+      release(left);
+      p = right;
+    }
+  }
+
+  // Make the node in 'slot' exclusively owned by the caller, which already
+  // owns the path to 'slot', by copying it if it is shared
+  node *unshare(node *&slot) {
+    node *p = slot;
+    if (p->references_.load(std::memory_order_acquire) != 1) {
+      node *q = create_node(std::as_const(p->value_));
+      q->left_ = acquire(p->left_);
+      q->right_ = acquire(p->right_);
+      q->size_ = p->size_;
+      slot = q;
+      release(p);
+      p = q;
+    }
+    return p;
+  }
+
+  // Rotate at the exclusively owned node in 'slot' if it is out of balance.
+  // The nodes to be moved are unshared before anything is changed; if that
+  // throws, the rotation is skipped and the exception kept in 'error', so
+  // that the modification in progress can be completed.
+  void balance(node *&slot, std::exception_ptr &error) noexcept {
+    try {
+      rotate(slot);
+    } catch (...) {
+      if (!error) { error = std::current_exception(); }
+    }
+  }
+
+  void rotate(node *&slot) {
+    node *a = slot;
+    if (!node::is_balanced(node::size(a->left_), node::size(a->right_))) {
+      node *b = unshare(a->right_);
+      if (node::is_single(node::size(b->left_), node::size(b->right_))) {
+        a->right_ = b->left_;
+        b->left_ = a;
+        a->recalculate_size();
+        b->recalculate_size();
+        slot = b;
+      } else {
+        node *c = unshare(b->left_);
+        a->right_ = c->left_;
+        b->left_ = c->right_;
+        c->left_ = a;
+        c->right_ = b;
+        a->recalculate_size();
+        b->recalculate_size();
+        c->recalculate_size();
+        slot = c;
+      }
+    } else if (!node::is_balanced(node::size(a->right_), node::size(a->left_))) {
+      node *b = unshare(a->left_);
+      if (node::is_single(node::size(b->right_), node::size(b->left_))) {
+        a->left_ = b->right_;
+        b->right_ = a;
+        a->recalculate_size();
+        b->recalculate_size();
+        slot = b;
+      } else {
+        node *c = unshare(b->right_);
+        a->left_ = c->right_;
+        b->right_ = c->left_;
+        c->right_ = a;
+        c->left_ = b;
+        a->recalculate_size();
+        b->recalculate_size();
+        c->recalculate_size();
+        slot = c;
+      }
+    }
+  }
+
+  // The modifying functions below unshare each node on the way down, which
+  // may throw but changes nothing observable, then change the sequence at
+  // the bottom, then rebalance on the way up, which does not throw
+
+  // Insert the singleton 'k' at position 'index' of the subtree in 'slot'
+  void insert_node(
+    node *&slot, std::size_t index, node *k, std::exception_ptr &error) {
+    if (!slot) {
+      slot = k;
+      return;
+    }
+    node *p = unshare(slot);
+    std::size_t left_size = node::size(p->left_);
+    if (index <= left_size) {
+      insert_node(p->left_, index, k, error);
+    } else {
+      insert_node(p->right_, index - left_size - 1, k, error);
+    }
+    p->recalculate_size();
+    balance(slot, error);
+  }
+
+  // Remove the last node of the nonempty subtree in 'slot' and return it
+  // as an exclusively owned singleton
+  node *remove_last(node *&slot, std::exception_ptr &error) {
+    node *p = unshare(slot);
+    if (!p->right_) {
+      slot = p->left_;
+      p->left_ = nullptr;
+      p->size_ = 1;
+      return p;
+    }
+    node *last = remove_last(p->right_, error);
+    p->recalculate_size();
+    balance(slot, error);
+    return last;
+  }
+
+  // Erase the node at position 'index' of the subtree in 'slot'
+  void erase_node(node *&slot, std::size_t index, std::exception_ptr &error) {
+    node *p = unshare(slot);
+    std::size_t left_size = node::size(p->left_);
+    if (index < left_size) {
+      erase_node(p->left_, index, error);
+    } else if (index > left_size) {
+      erase_node(p->right_, index - left_size - 1, error);
+    } else if (!p->left_ || !p->right_) {
+      slot = p->left_ ? p->left_ : p->right_;
+      p->left_ = p->right_ = nullptr;
+      release(p);
+      return;
+    } else {
+      // Replace 'p' with its predecessor
+      node *q = remove_last(p->left_, error);
+      q->left_ = std::exchange(p->left_, nullptr);
+      q->right_ = std::exchange(p->right_, nullptr);
+      release(p);
+      slot = p = q;
+    }
+    p->recalculate_size();
+    balance(slot, error);
+  }
+
+  // Build a perfectly balanced subtree from the next 'n' values
+  template <typename I> node *build_subtree(std::size_t n, I &first) {
+    if (!n) { return nullptr; }
+    node *left = build_subtree((n - 1) / 2, first);
+    node *p;
+    try {
+      p = create_node(*first);
+    } catch (...) {
+      release(left);
+      throw;
+    }
+    ++first;
+    p->left_ = left;
+    try {
+      p->right_ = build_subtree(n / 2, first);
+    } catch (...) {
+      release(p);
+      throw;
+    }
+    p->size_ = n;
+    return p;
+  }
+
+  static bool valid_subtree(const node *p) {
+    if (!p) { return true; }
+    std::size_t left = node::size(p->left_), right = node::size(p->right_);
+    return p->size_ == left + right + 1 && node::is_balanced(left, right) &&
+           node::is_balanced(right, left) && valid_subtree(p->left_) &&
+           valid_subtree(p->right_);
+  }
+
+public:
+  struct const_iterator {
+  private:
+    friend struct persistent_tree;
+    // The path from the root to the element, or empty at the end; the
+    // nodes below 'max_height' go in 'deep_', which is empty unless the
+    // tree is out of balance
+    const node *root_;
+    std::size_t depth_;
+    const node *path_[max_height];
+    std::vector<const node *> deep_;
+
+    explicit const_iterator(const node *root): root_(root), depth_(0) {}
+
+    const node *at(std::size_t d) const {
+      return d < max_height ? path_[d] : deep_[d - max_height];
+    }
+
+    const node *top() const { return depth_ ? at(depth_ - 1) : nullptr; }
+
+    void push(const node *p) {
+      if (depth_ < max_height) {
+        path_[depth_] = p;
+      } else {
+        deep_.resize(depth_ - max_height);
+        deep_.push_back(p);
+      }
+      ++depth_;
+    }
+
+    void copy_path(const const_iterator &other) {
+      root_ = other.root_;
+      depth_ = other.depth_;
+      std::copy(
+        other.path_, other.path_ + (std::min)(depth_, max_height), path_);
+      auto deep = other.deep_.begin();
+      deep_.assign(deep, deep + (depth_ > max_height ? depth_ - max_height : 0));
+    }
+
+    void push_first(const node *p) {
+      for (; p; p = p->left_) { push(p); }
+    }
+
+    void push_last(const node *p) {
+      for (; p; p = p->right_) { push(p); }
+    }
+
+    // Descend from the root to the first element 'x' which does not satisfy
+    // 'before(x)', or to the end
+    template <typename F> void descend(F &&before) {
+      std::size_t depth = 0;
+      for (const node *p = root_; p;) {
+        push(p);
+        if (before(p->value_)) {
+          p = p->right_;
+        } else {
+          depth = depth_;
+          p = p->left_;
+        }
+      }
+      depth_ = depth;
+    }
+
+  public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = const T *;
+    using reference = const T &;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    // Singular value required for range iterator
+    const_iterator(): root_(nullptr), depth_(0) {}
+
+    const_iterator(const const_iterator &other) { copy_path(other); }
+
+    const_iterator &operator=(const const_iterator &other) {
+      if (this != &other) { copy_path(other); }
+      return *this;
+    }
+
+    const T &operator*() const { return top()->value_; }
+    const T *operator->() const { return &top()->value_; }
+
+    const_iterator &operator++() {
+      const node *p = top();
+      if (p->right_) {
+        push_first(p->right_);
+      } else {
+        // Climb past the ancestors of which 'p' is in the right subtree
+        do {
+          p = at(--depth_);
+        } while (depth_ && at(depth_ - 1)->right_ == p);
+      }
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    const_iterator &operator--() {
+      const node *p = top();
+      if (!p) {
+        push_last(root_);
+      } else if (p->left_) {
+        push_last(p->left_);
+      } else {
+        do {
+          p = at(--depth_);
+        } while (depth_ && at(depth_ - 1)->left_ == p);
+      }
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    bool operator==(const const_iterator &other) const {
+      return top() == other.top();
+    }
+
+    bool operator!=(const const_iterator &other) const {
+      return top() != other.top();
+    }
+  };
+
+  using iterator = const_iterator;
+
+  ~persistent_tree() { release(root_); }
+
+  persistent_tree(): persistent_tree(Allocator()) {}
+
+  explicit persistent_tree(const Allocator &alloc):
+      root_(nullptr), alloc_(alloc) {}
+
+  template <std::input_iterator I, std::sentinel_for<I> S>
+  persistent_tree(I first, S last, const Allocator &alloc = Allocator()):
+      persistent_tree(alloc) {
+    if constexpr (std::sized_sentinel_for<S, I> && std::forward_iterator<I>) {
+      root_ = build_subtree(last - first, first);
+    } else {
+      for (; first != last; ++first) { insert(end(), *first); }
+    }
+  }
+
+  persistent_tree(const persistent_tree &other):
+      root_(acquire(other.root_)), alloc_(other.alloc_) {}
+
+  persistent_tree(persistent_tree &&other) noexcept:
+      root_(std::exchange(other.root_, nullptr)), alloc_(other.alloc_) {}
+
+  persistent_tree &operator=(const persistent_tree &other) {
+    node *p = acquire(other.root_);
+    release(root_);
+    root_ = p;
+    alloc_ = other.alloc_;
+    return *this;
+  }
+
+  persistent_tree &operator=(persistent_tree &&other) noexcept {
+    if (this != &other) {
+      release(root_);
+      root_ = std::exchange(other.root_, nullptr);
+      alloc_ = other.alloc_;
+    }
+    return *this;
+  }
+
+  persistent_tree snapshot() const { return *this; }
+
+  allocator_type get_allocator() const { return Allocator(alloc_); }
+
+  const_iterator begin() const {
+    const_iterator result(root_);
+    result.push_first(root_);
+    return result;
+  }
+
+  const_iterator end() const { return const_iterator(root_); }
+
+  std::size_t size() const { return node::size(root_); }
+
+  bool empty() const { return !root_; }
+
+  const_iterator nth(std::size_t index) const {
+    const_iterator result(root_);
+    if (index < size()) {
+      for (const node *p = root_;;) {
+        result.push(p);
+        std::size_t left_size = node::size(p->left_);
+        if (index < left_size) {
+          p = p->left_;
+        } else if (index > left_size) {
+          index -= left_size + 1;
+          p = p->right_;
+        } else {
+          break;
+        }
+      }
+    }
+    return result;
+  }
+
+  std::size_t rank(const_iterator i) const {
+    if (!i.depth_) { return size(); }
+    std::size_t result = node::size(i.top()->left_);
+    for (std::size_t d = 1; d != i.depth_; ++d) {
+      if (i.at(d) == i.at(d - 1)->right_) {
+        result += node::size(i.at(d - 1)->left_) + 1;
+      }
+    }
+    return result;
+  }
+
+  // Insert 'value' before 'position' and return an iterator to it
+  template <typename U> const_iterator insert(const_iterator position, U &&value) {
+    std::size_t index = rank(position);
+    node *k = create_node((U &&)value);
+    std::exception_ptr error;
+    try {
+      insert_node(root_, index, k, error);
+    } catch (...) {
+      release(k);
+      throw;
+    }
+    if (error) { std::rethrow_exception(error); }
+    return nth(index);
+  }
+
+  // Erase the element at 'position' and return an iterator to its successor
+  const_iterator erase(const_iterator position) {
+    std::size_t index = rank(position);
+    std::exception_ptr error;
+    erase_node(root_, index, error);
+    if (error) { std::rethrow_exception(error); }
+    return nth(index);
+  }
+
+  bool valid() const { return valid_subtree(root_); }
+
+  template <typename Comp> const_iterator lower_bound(Comp &&cmp) const {
+    const_iterator result(root_);
+    result.descend([&cmp](const T &x) { return cmp(x) < 0; });
+    return result;
+  }
+
+  template <typename Comp> const_iterator upper_bound(Comp &&cmp) const {
+    const_iterator result(root_);
+    result.descend([&cmp](const T &x) { return cmp(x) <= 0; });
+    return result;
+  }
+
+  template <typename Comp>
+  std::tuple<const_iterator, const_iterator> equal_range(Comp &&cmp) const {
+    return std::make_tuple(lower_bound(cmp), upper_bound(cmp));
+  }
+
+  template <typename LComp, typename RComp>
+  std::tuple<const_iterator, const_iterator> range_between(
+    LComp &&lcmp, RComp &&rcmp) const {
+    return std::make_tuple(lower_bound(lcmp), upper_bound(rcmp));
+  }
+};
+
+static_assert(
+  std::bidirectional_iterator<persistent_tree<int>::const_iterator>);
+
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+// A node pool allocator for use with 'wb::tree'.
+
+// The class template 'pool_allocator' is a standard allocator whose copies
+// share a single pool. The pool hands out fixed-size blocks carved in order
+// from large slabs, and keeps freed blocks on a free list for reuse, so that
+// a tree which repeatedly inserts and erases elements does not return to the
+// system allocator. Slabs are only released when the last copy of the
+// allocator is destroyed, or by 'release()', which a tree calls from
+// 'clear()' when it is the pool's sole owner.
+
+// The block size is fixed by the first single-object allocation (which for
+// 'wb::tree' is the first node); requests of any other size or alignment are
+// forwarded to the global 'operator new'.
+
+// The optional 'SizeType' becomes the allocator's 'size_type', which
+// 'wb::tree' also uses for the subtree size kept in each node.
+
+// Copies of a 'pool_allocator' compare equal and may deallocate each other's
+// blocks. The pool is not thread safe.
+
+namespace wb {
+
+namespace detail {
+
+struct pool_resource {
+  struct slab {
+    slab *next_;
+  };
+
+  std::size_t block_count_;
+  std::size_t block_size_{};
+  std::size_t block_align_{};
+  slab *slabs_{};
+  void *free_{};
+  std::byte *next_{};
+  std::byte *end_{};
+
+  explicit pool_resource(std::size_t block_count): block_count_(block_count) {}
+
+  pool_resource(const pool_resource &) = delete;
+  pool_resource &operator=(const pool_resource &) = delete;
+
+  ~pool_resource() { release(); }
+
+  // Free every slab, and with it every block handed out
+  void release() noexcept {
+    while (slabs_) {
+      slab *s = slabs_;
+      slabs_ = s->next_;
+      ::operator delete(s, std::align_val_t(block_align_));
+    }
+    free_ = nullptr;
+    next_ = end_ = nullptr;
+  }
+
+  // True if blocks of this size and alignment come from the pool;
+  // the first query fixes the block size
+  bool pooled(std::size_t size, std::size_t align) {
+    align = (std::max)(align, alignof(slab));
+    size = ((std::max)(size, sizeof(void *)) + align - 1) / align * align;
+    if (!block_size_) {
+      block_size_ = size;
+      block_align_ = align;
+    }
+    return size == block_size_ && align == block_align_;
+  }
+
+  void *allocate() {
+    if (void *p = free_) {
+      free_ = *static_cast<void **>(p);
+      return p;
+    }
+    if (next_ == end_) {
+      // The slab header occupies the first block
+      std::size_t bytes = (block_count_ + 1) * block_size_;
+      slab *s = static_cast<slab *>(
+        ::operator new(bytes, std::align_val_t(block_align_)));
+      s->next_ = slabs_;
+      slabs_ = s;
+      next_ = reinterpret_cast<std::byte *>(s) + block_size_;
+      end_ = reinterpret_cast<std::byte *>(s) + bytes;
+    }
+    void *p = next_;
+    next_ += block_size_;
+    return p;
+  }
+
+  void deallocate(void *p) {
+    *static_cast<void **>(p) = free_;
+    free_ = p;
+  }
+};
+
+}
+
+template <typename T, std::size_t BlockCount = 1024,
+  typename SizeType = std::size_t>
+struct pool_allocator {
+  using value_type = T;
+  using size_type = SizeType;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  template <typename U> struct rebind {
+    using other = pool_allocator<U, BlockCount, SizeType>;
+  };
+
+  pool_allocator():
+      resource_(std::make_shared<detail::pool_resource>(BlockCount)) {}
+
+  template <typename U>
+  pool_allocator(
+    const pool_allocator<U, BlockCount, SizeType> &other) noexcept:
+      resource_(other.resource_) {}
+
+  T *allocate(size_type n) {
+    if (n == 1 && resource_->pooled(sizeof(T), alignof(T))) {
+      return static_cast<T *>(resource_->allocate());
+    } else {
+      return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+  }
+
+  void deallocate(T *p, size_type n) noexcept {
+    if (n == 1 && resource_->pooled(sizeof(T), alignof(T))) {
+      resource_->deallocate(p);
+    } else {
+      ::operator delete(p, std::align_val_t(alignof(T)));
+    }
+  }
+
+  // True if no other allocator shares this pool, in which case destroying
+  // this allocator releases every block it handed out in one step
+  bool sole_owner() const noexcept { return resource_.use_count() == 1; }
+
+  // Free every pooled block at once, for a sole owner none of whose blocks
+  // are still in use
+  void release() noexcept { resource_->release(); }
+
+  template <typename U>
+  bool operator==(
+    const pool_allocator<U, BlockCount, SizeType> &other) const noexcept {
+    return resource_ == other.resource_;
+  }
+
+private:
+  template <typename, std::size_t, typename> friend struct pool_allocator;
+  std::shared_ptr<detail::pool_resource> resource_;
+};
+
+// A pool allocator with a 32-bit 'size_type', for trees of fewer than 2^32
+// elements with compact nodes
+template <typename T, std::size_t BlockCount = 1024>
+using compact_pool_allocator = pool_allocator<T, BlockCount, std::uint32_t>;
+
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "tree.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <queue>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// A reference sweep-line engine reporting the intersections of segments.
+
+// The function 'sweep_intersections(segments, report)' runs the algorithm of
+// [BentleyOttmann1979], handling the degenerate cases as in [deBerg2008]:
+// a vertical line sweeps the plane from left to right, stopping at each
+// event point, which is an endpoint of a segment or a point where two
+// segments cross, and keeps the segments it meets in a 'wb::tree' ordered
+// from bottom to top. At each event point 'p' it finds the segments
+// containing 'p' with 'range_between', calls 'report(p, indices)' if there
+// are two or more (counting the segments that start there), then replaces
+// them by those that continue past 'p', ordered by slope: two crossing
+// segments trade places with 'exchange_elements', and the segments that
+// start at 'p' go in with 'insert'. Only the segments that become
+// neighbours are tested for crossings further on, so the sweep takes
+// O((n + k) log n) time for 'n' segments and 'k' event points.
+
+// The coordinates are integers of magnitude below 2^19, so that the
+// intersection points' rational coordinates and every predicate on them
+// are exact in 128 bits; the function throws 'std::invalid_argument' for
+// larger ones. Any configuration is allowed: vertical segments, segments
+// of zero length, several segments through one point, endpoints on other
+// segments, and overlapping collinear segments, which are reported as
+// meeting at the event points they share. The function returns the
+// number of event points, and 'report' receives the point and a span of
+// the indices of the segments containing it, in no particular order:
+//   std::vector<wb::sweep_segment> segments{
+//     {{0, 0}, {4, 4}}, {{0, 4}, {4, 0}}};
+//   wb::sweep_intersections(segments,
+//     [](const wb::sweep_event_point &p, std::span<const std::size_t> s) {
+//       // p.x / p.den == 2, p.y / p.den == 2, s holds 0 and 1
+//     });
+
+namespace wb {
+
+// A point with integer coordinates
+struct sweep_point {
+  std::int32_t x, y;
+};
+
+struct sweep_segment {
+  sweep_point a, b;
+};
+
+// An event point, with the rational coordinates 'x / den' and 'y / den'
+// for a positive 'den'
+struct sweep_event_point {
+  std::int64_t x, y, den;
+};
+
+namespace detail {
+
+// The sign of 'a * b - c * d', computed exactly
+inline int compare_products(
+  std::int64_t a, std::int64_t b, std::int64_t c, std::int64_t d) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef __int128 wide;
+  wide l = (wide)a * b, r = (wide)c * d;
+  return (l > r) - (l < r);
+#else
+  // Compare the signs, then the magnitudes as pairs of 64-bit halves
+  int sl = (a > 0) - (a < 0), sr = (c > 0) - (c < 0);
+  sl *= (b > 0) - (b < 0);
+  sr *= (d > 0) - (d < 0);
+  if (sl != sr || !sl) { return (sl > sr) - (sl < sr); }
+  auto magnitude = [](std::int64_t x) {
+    return x < 0 ? ~(std::uint64_t)x + 1 : (std::uint64_t)x;
+  };
+  auto multiply = [](std::uint64_t x, std::uint64_t y, std::uint64_t &high) {
+    std::uint64_t x0 = x & 0xffffffff, x1 = x >> 32;
+    std::uint64_t y0 = y & 0xffffffff, y1 = y >> 32;
+    std::uint64_t p00 = x0 * y0, p01 = x0 * y1, p10 = x1 * y0;
+    std::uint64_t middle =
+      (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+    high = x1 * y1 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+    return (middle << 32) | (p00 & 0xffffffff);
+  };
+  std::uint64_t lh, rh;
+  std::uint64_t ll = multiply(magnitude(a), magnitude(b), lh);
+  std::uint64_t rl = multiply(magnitude(c), magnitude(d), rh);
+  int m = lh != rh ? (lh > rh) - (lh < rh) : (ll > rl) - (ll < rl);
+  return sl * m;
+#endif
+}
+
+// The lexicographic order of event points, by 'x' and then by 'y'
+inline int compare_points(
+  const sweep_event_point &p, const sweep_event_point &q) {
+  if (int c = compare_products(p.x, q.den, q.x, p.den)) { return c; }
+  return compare_products(p.y, q.den, q.y, p.den);
+}
+
+struct sweep_line {
+  // The segments with their endpoints in lexicographic order
+  std::vector<sweep_segment> segments_;
+
+  // The status: the indices of the segments crossing the sweep line
+  tree<std::size_t> status_;
+
+  // Crossings found ahead of the sweep line, smallest first, possibly
+  // more than once each
+  struct later {
+    bool operator()(
+      const sweep_event_point &p, const sweep_event_point &q) const {
+      return compare_points(p, q) > 0;
+    }
+  };
+  std::priority_queue<sweep_event_point, std::vector<sweep_event_point>,
+    later>
+    crossings_;
+
+  static sweep_event_point event_point(const sweep_point &p) {
+    return {p.x, p.y, 1};
+  }
+
+  // The extent of a segment along each axis
+  static std::int64_t dx(const sweep_segment &s) {
+    return (std::int64_t)s.b.x - s.a.x;
+  }
+  static std::int64_t dy(const sweep_segment &s) {
+    return (std::int64_t)s.b.y - s.a.y;
+  }
+
+  // The side of the segment 'i' on which 'p' lies: positive above (or to
+  // the left of a vertical segment), zero on its line
+  int orientation(std::size_t i, const sweep_event_point &p) const {
+    const sweep_segment &s = segments_[i];
+    return compare_products(
+      dx(s), p.y - s.a.y * p.den, dy(s), p.x - s.a.x * p.den);
+  }
+
+  // Whether the segment 'i' leaves 'p' with a smaller slope than 'j'; the
+  // segments both contain 'p' and do not end there
+  bool lower_after(std::size_t i, std::size_t j) const {
+    const sweep_segment &s = segments_[i], &t = segments_[j];
+    std::int64_t c = dy(s) * dx(t) - dy(t) * dx(s);
+    return c < 0 || (c == 0 && i < j);
+  }
+
+  // Queue the point where the segments 'i' and 'j' cross, if it is a
+  // single point after 'p'; collinear segments meet in the event points
+  // at their endpoints instead
+  void check_crossing(
+    std::size_t i, std::size_t j, const sweep_event_point &p) {
+    const sweep_segment &s = segments_[i], &t = segments_[j];
+    std::int64_t rx = dx(s), ry = dy(s), qx = dx(t), qy = dy(t);
+    std::int64_t ex = (std::int64_t)t.a.x - s.a.x;
+    std::int64_t ey = (std::int64_t)t.a.y - s.a.y;
+    std::int64_t den = rx * qy - ry * qx;
+    if (!den) { return; }
+    // The crossing is at 's.a + (u / den) (s.b - s.a)' and at
+    // 't.a + (v / den) (t.b - t.a)'
+    std::int64_t u = ex * qy - ey * qx, v = ex * ry - ey * rx;
+    if (den < 0) {
+      den = -den;
+      u = -u;
+      v = -v;
+    }
+    if (u < 0 || u > den || v < 0 || v > den) { return; }
+    sweep_event_point q{s.a.x * den + rx * u, s.a.y * den + ry * u, den};
+    if (compare_points(q, p) > 0) { crossings_.push(q); }
+  }
+
+  std::size_t run(std::span<const sweep_segment> segments, auto &report) {
+    constexpr std::int32_t limit = std::int32_t{1} << 19;
+    segments_.assign(segments.begin(), segments.end());
+    for (sweep_segment &s: segments_) {
+      for (const sweep_point &e: {s.a, s.b}) {
+        if (e.x <= -limit || e.x >= limit || e.y <= -limit || e.y >= limit) {
+          throw std::invalid_argument("wb: sweep coordinates out of range");
+        }
+      }
+      if (s.b.x < s.a.x || (s.b.x == s.a.x && s.b.y < s.a.y)) {
+        std::swap(s.a, s.b);
+      }
+    }
+    // The segments in the order of their left and of their right endpoints
+    std::vector<std::size_t> starts(segments_.size());
+    for (std::size_t i = 0; i != starts.size(); ++i) { starts[i] = i; }
+    std::vector<std::size_t> ends = starts;
+    auto by = [this](sweep_point sweep_segment::*end) {
+      return [this, end](std::size_t i, std::size_t j) {
+        return compare_points(event_point(segments_[i].*end),
+                 event_point(segments_[j].*end)) < 0;
+      };
+    };
+    std::ranges::sort(starts, by(&sweep_segment::a));
+    std::ranges::sort(ends, by(&sweep_segment::b));
+    auto next_start = starts.begin();
+    auto next_end = ends.begin();
+    auto start_point = [&] { return event_point(segments_[*next_start].a); };
+    auto end_point = [&] { return event_point(segments_[*next_end].b); };
+    std::size_t events = 0;
+    std::vector<std::size_t> found, after;
+    for (; next_end != ends.end(); ++events) {
+      // The next event point; every segment ends after it starts
+      sweep_event_point p = end_point();
+      if (next_start != starts.end() && compare_points(start_point(), p) < 0) {
+        p = start_point();
+      }
+      if (!crossings_.empty() && compare_points(crossings_.top(), p) < 0) {
+        p = crossings_.top();
+      }
+      while (!crossings_.empty() && !compare_points(crossings_.top(), p)) {
+        crossings_.pop();
+      }
+      while (next_end != ends.end() && !compare_points(end_point(), p)) {
+        ++next_end;
+      }
+      // The segments containing 'p': those already crossing the sweep line,
+      // which are contiguous in the status, and those starting at 'p'
+      auto cmp = [this, &p](std::size_t i) { return -orientation(i, p); };
+      auto [first, last] = status_.range_between(cmp, cmp);
+      found.assign(first, last);
+      std::size_t crossing = found.size();
+      for (; next_start != starts.end() && !compare_points(start_point(), p);
+           ++next_start) {
+        found.push_back(*next_start);
+      }
+      if (found.size() > 1) {
+        report(p, std::span<const std::size_t>(found));
+      }
+      // The segments continuing past 'p', from bottom to top
+      after.clear();
+      for (std::size_t i: found) {
+        if (compare_points(event_point(segments_[i].b), p)) {
+          after.push_back(i);
+        }
+      }
+      std::ranges::sort(after,
+        [this](std::size_t i, std::size_t j) { return lower_after(i, j); });
+      auto below = first == status_.begin() ? status_.end() : std::prev(first);
+      auto above = last;
+      if (crossing == 2 && after.size() == 2 && after[0] == found[1] &&
+          after[1] == found[0]) {
+        // The common case of two segments crossing
+        status_.exchange_elements(first, std::next(first));
+      } else {
+        // Reuse the nodes of the segments found, in place, for those
+        // continuing, then erase the rest or insert the new ones
+        auto position = first;
+        std::size_t k = 0;
+        for (; k != after.size() && position != last; ++k, ++position) {
+          *position = after[k];
+        }
+        status_.erase(position, last);
+        for (; k != after.size(); ++k) { status_.insert(last, after[k]); }
+      }
+      if (after.empty()) {
+        if (below != status_.end() && above != status_.end()) {
+          check_crossing(*below, *above, p);
+        }
+      } else {
+        if (below != status_.end()) {
+          check_crossing(*below, after.front(), p);
+        }
+        if (above != status_.end()) {
+          check_crossing(after.back(), *above, p);
+        }
+      }
+    }
+    status_.clear();
+    return events;
+  }
+};
+
+}
+
+template <typename Report>
+std::size_t sweep_intersections(
+  std::span<const sweep_segment> segments, Report &&report) {
+  detail::sweep_line sweep;
+  return sweep.run(segments, report);
+}
+
+}
@@ -1,7 +1,21 @@
 #pragma once
 
+#include "execution.hpp"
 #include "node.hpp"
 
+#include <algorithm>
+#include <compare>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 // An ordered associative container representing an arbitrary sequence
 // of values and allowing binary search with arbitrary comparators.
 // The user must establish the precondition that the sequence is ordered
@@ -9,28 +23,210 @@
 
 // This may be useful in situations where the order changes dynamically, such
 // as the Bentley-Ottmann algorithm [BentleyOttmann1979] and similar sweep-line
-// algorithms. It is implemented as a weight-balanced tree [HiraiYamamoto2011].
+// algorithms ('sweep.hpp' holds a reference implementation of the former).
+// It is implemented as a weight-balanced tree [HiraiYamamoto2011].
 
 // The class template 'tree' provides the following standard container methods:
 //   ~tree(); // destructor
 //   tree(); // default constructor
+//   explicit tree(const Allocator &alloc);
+//   tree(first, last, alloc = Allocator());
+//   tree(const tree &other); // copy constructor
+//   tree(tree &&other); // move constructor
+//   tree &operator=(const tree &other);
+//   tree &operator=(tree &&other);
+//   void swap(tree &other);
+//   void assign(first, last);
+//   void clear();
+//   allocator_type get_allocator() const;
 //   iterator begin();
 //   iterator end();
 //   const_iterator begin() const;
 //   const_iterator end() const;
 //   std::size_t size() const;
 //   bool empty() const;
+//   std::size_t max_size() const;
+//   bool valid() const; // check structural invariants, for testing
+
+// Nodes are obtained from 'Allocator' rebound to the node type. With the
+// bundled 'wb::pool_allocator' (see 'pool.hpp'), erased nodes are recycled
+// through the pool's free list, and if the pool is not shared with another
+// allocator and both 'T' and the augmentation's summary type are trivially
+// destructible, the destructor releases the pool's slabs wholesale instead
+// of visiting each node; 'clear()' then releases them through the pool in
+// one step too.
+
+// Moving or swapping trees takes constant time and invalidates only the
+// 'end()' iterators: the nodes, and iterators to them, pass to the other
+// tree. As for the standard containers, a move assignment between trees
+// whose allocators neither propagate nor compare equal moves the elements
+// one by one instead, and swapping such trees is undefined. The copy
+// constructor and copy assignment clone the shape of the tree directly,
+// node for node, in linear time without comparing or rebalancing. Copy
+// assignment leaves the tree unchanged if an exception is thrown.
+
+// The constructor 'tree(first, last)' and the method 'assign(first, last)'
+// make the tree's sequence a copy of '[first, last)'. The balanced shape is
+// built directly in time linear in the length of the range, without any
+// rebalancing; the range need not be sized, but, as with any sequence in
+// the tree, must be ordered compatibly with the comparators used to search
+// it. If an exception is thrown, 'assign' leaves the tree unchanged.
+
+// Each node stores its subtree size as the allocator's 'size_type', ahead of
+// the value. An allocator with a 32-bit 'size_type', such as
+// 'wb::compact_pool_allocator', makes the nodes of small value types more
+// compact, at the cost of limiting the tree to 'max_size()' elements.
+
+// The optional 'Traits' parameter configures the tree. With the default
+// 'wb::tree_traits' no statistics are collected and the counters compile
+// away; with 'wb::stats_tree_traits' the tree counts rotations, nodes visited
+// while rebalancing, comparator calls made by the search methods, and node
+// allocations, and the method 'stats()' returns these counters together
+// with the height of the tree and the number of nodes at each depth. The
+// method 'reset_stats()' zeroes the counters.
+
+// The traits' member type 'balance' is a 'wb::balance_policy<Delta, Gamma>'
+// holding the parameters of the weight balance as 'std::ratio's; the
+// default is 'balance_policy<std::ratio<3>, std::ratio<2>>'. A looser
+// balance rotates less often when inserting and erasing but lets searches
+// descend further, a tighter one the reverse; parameters outside the valid
+// region of [HiraiYamamoto2011], which could leave nodes out of balance,
+// fail to compile. For example:
+//   struct loose_traits: wb::tree_traits {
+//     using balance = wb::balance_policy<std::ratio<4>, std::ratio<3, 2>>;
+//   };
+// The benchmark 'bm_balance' compares the valid settings on a mixed
+// workload, reporting throughput, rotations and average depth.
+
+// The first and last elements are cached in the sentinel node, so 'begin()'
+// and decrementing 'end()' take constant time.
 
 // The method 'insert(position, value)' inserts 'value' before 'position',
 // which must be a valid iterator pointing to an element or to the end of
 // the sequence. It returns an iterator to the inserted element.
 // No existing iterators are invalidated.
 
+// An object of the nested type 'deferred_balance', constructed from a tree,
+// defers rebalancing for bursts of insertions. While it is alive, 'insert'
+// links each new node as a leaf and marks it pending, touching neither the
+// other nodes' sizes nor their summaries, so it costs only the walk to the
+// leaf. When the guard is destroyed, each subtree of pending nodes is cut
+// off, rebuilt perfectly balanced and joined back in at its rank, in time
+// linear in the pending nodes plus logarithmic in the tree for each such
+// subtree. The pending subtrees are not balanced meanwhile, so neighbouring
+// insertions form a chain, and a search that descends into it is linear in
+// its length: insert at an iterator, as returned by the previous 'insert',
+// rather than searching for each position. The methods that use subtree
+// sizes or summaries, or modify the tree otherwise, rebalance first, and
+// since the const ones among them ('size()' excepted) do so too, the tree
+// must not be shared between threads while a guard is alive; nor may
+// indexed iterator arithmetic be used then. Iterators are neither
+// invalidated nor relocated. A guard on a tree that already has one has no
+// effect, and the tree must outlive the guard. 'wbtree_bench' compares
+// deferred and plain insertion on bursts of neighbouring values.
+
+// The method 'emplace(position, args...)' inserts 'T(args...)', constructed
+// in its node, before 'position', and returns an iterator to it. The method
+// 'extract(position)' unlinks the element at 'position' and returns a
+// 'node_type' handle owning its node, and 'insert(position, handle)' links
+// the handle's node back in before 'position' (the allocators must compare
+// equal), so an element can be moved between positions or trees without
+// freeing, allocating or copying anything. Iterators to the extracted
+// element are invalidated until it is reinserted, after which they refer
+// to it in its new position. The method 'relocate(from, to)' does both at
+// once: it moves the element at 'from' to just before 'to', and 'from'
+// remains valid, pointing to the element in its new position. No other
+// iterators are invalidated.
+
+// The traits' member type 'augmentation', if not void, augments each node
+// with a summary of its subtree, so that range aggregates take logarithmic
+// time. It must provide
+//   using value_type = ...; // the summary type, also 'tree::summary_type'
+//   static value_type identity(); // the summary of an empty range
+//   static value_type lift(const T &x); // the summary of one element
+//   static value_type combine(const value_type &a, const value_type &b);
+// where 'combine' is associative with 'identity()' as its identity, but
+// need not be commutative, and is applied to summaries in sequence order.
+// The tree keeps the summaries up to date through every modifying method,
+// recalculating them along the paths it already walks to rebalance and in
+// each rotation; 'valid()' also checks them if they are equality
+// comparable. The method 'aggregate(first, last)' returns the combined
+// summary of '[first, last)' and takes logarithmic time, and 'aggregate()'
+// returns that of the whole tree in constant time. An element modified in
+// place, through an iterator, 'for_each' or 'wb::parallel_for_each', leaves
+// the summaries above it stale until 'refresh(position)' recalculates them,
+// which takes logarithmic time. Without an augmentation the summaries
+// compile away.
+
 // The method 'erase(position)' erases the element pointed to by the
 // iterator 'position', which must be a valid iterator pointing to an
 // element. Iterators to the erased element are invalidated. No other
 // iterators are invalidated.
 
+// The method 'erase(first, last)' erases the elements in the range
+// '[first, last)' and returns 'last'. It cuts the range out with 'split'
+// and closes the gap with 'join', so it takes time logarithmic in the size
+// of the tree plus linear in the number of elements erased, and rebalances
+// only along the two cut paths. Iterators to the erased elements are
+// invalidated. No other iterators are invalidated.
+
+// The method 'reverse(first, last)' reverses the order of the elements in
+// '[first, last)', and 'exchange_ranges(a_first, a_last, b_first, b_last)'
+// exchanges the positions of two disjoint ranges, which may differ in
+// length, keeping the elements between them in place; this suits a sweep
+// line on which several segments meet at one point and their order
+// reverses. Each cuts the ranges out with 'split' and rejoins the pieces
+// with 'join', taking time logarithmic in the size of the tree, except
+// that 'reverse' also exchanges the children of each node of the range,
+// which is linear in its length but moves no values and needs no
+// rebalancing, since a mirrored weight-balanced subtree is balanced.
+// Ranges shorter than about sixteen thousand elements, as measured by the
+// ranks of their ends, are reversed instead by exchanging nodes pairwise
+// from both ends, which is cheaper there. No
+// iterators are invalidated: like 'exchange_elements', both relocate the
+// elements, so iterators follow them to their new positions.
+
+// The order-statistic methods use the subtree sizes kept in each node and
+// take logarithmic time:
+//   iterator nth(std::size_t index); // or end() if index >= size()
+//   const_iterator nth(std::size_t index) const;
+//   std::size_t rank(const_iterator i) const; // distance from begin to i
+//   std::ptrdiff_t distance(const_iterator i, const_iterator j) const;
+
+// The types 'indexed_iterator' and 'const_indexed_iterator' are random
+// access iterators that wrap 'iterator' and 'const_iterator' respectively
+// and convert to and from them. Increment and decrement cost the same as
+// for the wrapped iterators; the operations '+=', '-=', '+', '-', '[]'
+// and the ordering comparisons use subtree sizes and take logarithmic time,
+// so that algorithms such as 'std::ranges::advance', 'std::ranges::distance'
+// or a partitioned parallel scan can divide a range without walking it.
+// The method 'indexed()' returns the whole sequence as a range of indexed
+// iterators, and 'base()' recovers the wrapped iterator.
+
+// The method 'for_each(f)' calls 'f(x)' for each element 'x' in order, and
+// 'for_each(first, last, f)' for each element in '[first, last)'. Rather
+// than stepping an iterator, whose increment may climb several parents, it
+// walks the tree directly, visiting each node once and prefetching each
+// right subtree while the left one is visited, so it suits bulk passes
+// such as exporting or serializing a tree. The method 'copy_to(out)' copies
+// the elements in order to the output iterator 'out' and returns the end
+// of the output.
+
+// The function 'wb::parallel_for_each(policy, tree, f)' (see 'parallel.hpp')
+// divides the elements by rank into chunks run under an execution policy,
+// and visits each chunk in the same way.
+
+// The function 'wb::freeze(tree)' (see 'frozen_tree.hpp') returns a
+// 'wb::frozen_tree', an immutable copy of the sequence in a contiguous,
+// search-friendly layout, supporting the same binary search methods, for
+// read-mostly phases. Building it takes linear time.
+
+// For trivially copyable 'T', the function 'wb::serialize(tree, out)' (see
+// 'image.hpp') writes an image of the sequence to the 'std::ostream' 'out',
+// and 'wb::load(tree, image)' makes the sequence a copy of an image's
+// values, given as a span of bytes, in linear time and without
+// comparisons; 'wb::image_view' searches an image in place.
+
 // The method 'exchange_elements(i, j)' exchanges the elements pointed to
 // by the iterators 'i' and 'j', which must be valid iterators pointing
 // to elements, without moving any other values in the sequence. No iterators
@@ -38,6 +234,44 @@
 // 'exchange_elements' returns they point to the old element in its new
 // position in the sequence.
 
+// The method 'split(position)' removes the elements in '[position, end)'
+// and returns them as a new tree. The function 'join(left, right)' returns
+// a tree holding the elements of 'left' followed by those of 'right', and
+// leaves both arguments empty. The method 'splice(position, other)' moves
+// the elements of 'other' into this tree before 'position', leaving 'other'
+// empty. Each takes logarithmic time, requires that the allocators of the
+// trees involved compare equal, and invalidates no iterators other than
+// 'end()': iterators to moved elements refer to them in their new tree.
+
+// The functions 'merge(a, b, cmp)', 'intersection(a, b, cmp)' and
+// 'difference(a, b, cmp)' take two trees by rvalue reference, leave them
+// empty and return a tree holding, respectively, the elements of both, the
+// elements of 'a' equivalent to some element of 'b', and the elements of
+// 'a' equivalent to no element of 'b'. The binary comparator 'cmp(x, y)'
+// returns a value which compares with zero as 'x <=> y' would, and both
+// sequences must be ordered by it. 'merge' is stable: equivalent elements
+// of 'a' precede those of 'b'. Nodes are moved, not copied, and the
+// allocators of the trees must compare equal. The algorithms are the
+// join-based divide and conquer of [BlellochFerizovicSun2016], taking
+// O(m log(n/m + 1)) comparisons for sizes m <= n. Each function has an
+// overload taking an execution policy first (see 'execution.hpp'), under
+// which the two recursive calls are forked onto a new thread at the top
+// few levels of recursion, for subproblems of at least the policy's grain
+// size. Under a parallel policy 'cmp' is called from several threads and
+// must not throw. Otherwise 'cmp' may throw, and then the elements of both
+// trees are destroyed, leaving both empty, before the exception propagates.
+
+// The method 'insert_sorted(first, last, cmp)' inserts copies of a batch of
+// values ordered by the binary comparator 'cmp', as 'merge' would with a
+// tree of them: it builds the batch into a perfectly balanced subtree and
+// merges that in, so inserting m values into n elements takes
+// O(m log(n/m + 1)) comparisons rather than a descent and a walk up to the
+// root for each value. Each value goes after the elements equivalent to it,
+// and equivalent values of the batch keep their order. An overload takes
+// an execution policy first, as 'merge' does. If copying a value throws,
+// or 'cmp' does under the sequenced policy, the tree is unchanged. No
+// iterators are invalidated.
+
 // The binary search methods 'lower_bound(cmp)', 'upper_bound(cmp)',
 // 'equal_range(cmp)' assume that the tree is partitioned by the
 // comparator 'cmp', that is, there are iterators 'i' and 'j' such that
@@ -47,6 +281,16 @@
 // Then 'lower_bound' returns 'i', 'upper_bound' returns 'j' and
 // 'equal_range' returns the tuple '(i, j)'.
 
+// When 'T' is small and trivially copyable and 'cmp' returns a standard
+// comparison category, as 'x <=> a' does for numbers, 'lower_bound' and
+// 'upper_bound' (including the descents below the split in
+// 'range_between') select each child with conditional moves rather than
+// branches, and prefetch both children of each node while comparing it.
+// Such comparisons are cheap and their outcomes unpredictable, so this
+// avoids a misprediction per level and overlaps each level's cache miss
+// with the comparison above it. A comparator returning 'int' keeps the
+// branching descent, which may be faster on trees that fit in the cache.
+
 // The remaining binary search method 'equal_range(lcmp, rcmp)' assumes
 // that the tree is partitioned by both comparators 'lcmp' and 'rcmp'
 // and that 'lcmp(x) <= rcmp(x)' for all elements 'x' and returns the
@@ -54,18 +298,319 @@
 //   lcmp(x) returns -1 if and only if x is in [begin, i)
 //   rcmp(x) returns +1 if and only if x is in [j, end)
 
+// The batched methods 'lower_bounds(first, last, out)' and
+// 'equal_ranges(first, last, out)' take a forward range of comparators,
+// ordered so that their results are in order, and write the result of
+// 'lower_bound(cmp)' or 'equal_range(cmp)' for each comparator to the
+// output iterator 'out'. They walk the tree once, dividing the batch by
+// binary search at each node visited, so queries share the comparisons
+// made on their common path from the root.
+
+// Each binary search method has a finger search overload taking an iterator
+// 'hint' as its first argument, such as 'lower_bound(hint, cmp)' or
+// 'range_between(hint, lcmp, rcmp)'. It returns the same result, but climbs
+// from 'hint' until the subtree there brackets the result and then descends,
+// so that it takes time logarithmic in the distance 'd' from 'hint' to the
+// result rather than in the size of the tree. This suits sweep-line loops
+// whose successive queries land close to one another.
+
 namespace wb {
 
-template <typename T> struct tree {
+// The default traits for 'wb::tree'
+struct tree_traits {
+  // Collect the statistics reported by 'tree::stats()'
+  static constexpr bool collect_stats = false;
+
+  // Summarize each subtree for 'tree::aggregate', if not void
+  using augmentation = void;
+
+  // The parameters of the weight balance
+  using balance = balance_policy<>;
+};
+
+// Traits for a tree which collects statistics
+struct stats_tree_traits: tree_traits {
+  static constexpr bool collect_stats = true;
+};
+
+// A snapshot of a tree's statistics: the counters, collected since the tree
+// was constructed or since 'reset_stats()' was last called, and the shape of
+// the tree as it is now
+struct tree_stats {
+  std::size_t single_rotations; // in 'balance_left' and 'balance_right'
+  std::size_t double_rotations;
+  std::size_t rebalances; // calls to 'balance_above'
+  std::size_t rebalance_nodes; // nodes visited by 'balance_above'
+  std::size_t searches; // calls to the binary and finger search methods
+  std::size_t comparisons; // comparator calls by those methods
+  std::size_t allocations; // nodes allocated
+  std::size_t deallocations; // nodes deallocated one at a time
+  std::size_t height; // number of nodes on the longest path from the root
+  std::vector<std::size_t> depth_histogram; // number of nodes at each depth
+};
+
+template <typename T, typename Allocator = std::allocator<T>,
+  typename Traits = tree_traits>
+struct tree {
+  using allocator_type = Allocator;
+  using traits_type = Traits;
+  using summary_type =
+    typename detail::summary_of<typename Traits::augmentation>::type;
+
 private:
-  detail::node<T> sentinel_;
+  using node =
+    detail::node<T, typename std::allocator_traits<Allocator>::size_type,
+      Traits::collect_stats, typename Traits::augmentation,
+      typename Traits::balance>;
+  using node_allocator_type = typename std::allocator_traits<
+    Allocator>::template rebind_alloc<node>;
+  using node_traits = std::allocator_traits<node_allocator_type>;
+
+  node sentinel_;
+  [[no_unique_address]] node_allocator_type alloc_;
+  [[no_unique_address]] std::conditional_t<Traits::collect_stats,
+    detail::stats_counters, detail::no_stats_counters> stats_;
 
 public:
+  struct deferred_balance;
+
+private:
+  deferred_balance *deferred_{};
+
+  // Direct the rebalancing counters to this tree, if statistics are enabled
+  void track_stats() {
+    if constexpr (Traits::collect_stats) {
+      detail::stats_counters::current = &stats_;
+    }
+  }
+
+  // Wrap a comparator to count its calls, if statistics are enabled
+  template <typename Comp> decltype(auto) counted(Comp &&cmp) {
+    if constexpr (Traits::collect_stats) {
+      ++stats_.searches;
+      return [this, &cmp](auto &&x) {
+        ++stats_.comparisons;
+        return cmp((decltype(x) &&)x);
+      };
+    } else {
+      return (Comp &&)cmp;
+    }
+  }
+
+  // Call 'f' on the values of the first 'count' nodes of the subtree 'p',
+  // in order, and subtract the number visited from 'count'. Subtrees are
+  // entered by recursion on the left and iteration on the right, so no
+  // node is visited twice, and the right child is prefetched while the
+  // left subtree is visited.
+  template <typename P, typename F>
+  static void for_each_in_subtree(P p, std::size_t &count, F &f) {
+    for (; p && count; p = p->right_) {
+      if (p->right_) { detail::prefetch(p->right_); }
+      for_each_in_subtree(p->left_, count, f);
+      if (!count) { return; }
+      f(p->value_);
+      --count;
+    }
+  }
+
+  // Call 'f' on the values of the 'count' nodes starting at 'first': each
+  // node is followed by its right subtree and then by the ancestor reached
+  // by climbing out of right subtrees
+  template <typename P, typename F>
+  static void for_each_span(P first, std::size_t count, F &f) {
+    for (P p = first; count;) {
+      f(p->value_);
+      if (!--count) { return; }
+      for_each_in_subtree(p->right_, count, f);
+      if (!count) { return; }
+      while (p == p->parent_->right_) { p = p->parent_; }
+      p = p->parent_;
+    }
+  }
+
+  static void count_depths(
+    const node *p, std::size_t depth, std::vector<std::size_t> &histogram) {
+    for (; p; p = p->right_, ++depth) {
+      if (histogram.size() == depth) { histogram.push_back(0); }
+      ++histogram[depth];
+      count_depths(p->left_, depth + 1, histogram);
+    }
+  }
+
+  template <typename... Args> node *create_node(Args &&...args) {
+    node *p = node_traits::allocate(alloc_, 1);
+    if constexpr (Traits::collect_stats) { ++stats_.allocations; }
+    try {
+      node_traits::construct(alloc_, p, std::in_place, (Args &&)args...);
+    } catch (...) {
+      node_traits::deallocate(alloc_, p, 1);
+      throw;
+    }
+    return p;
+  }
+
+  void destroy_node(node *p) {
+    node_traits::destroy(alloc_, p);
+    node_traits::deallocate(alloc_, p, 1);
+    if constexpr (Traits::collect_stats) { ++stats_.deallocations; }
+  }
+
+  // Record the singleton 'p' for the active 'deferred_balance' guard, if
+  // any, before it is linked
+  void record_inserted(node *p) {
+    if (deferred_) { deferred_->inserted_.push_back(p); }
+  }
+
+  // Link the singleton 'p' into the sequence before 'position'
+  node *link_node(node *position, node *p) {
+    if (position == sentinel_.right_) { sentinel_.right_ = p; }
+    if (position == &sentinel_) { sentinel_.parent_ = p; }
+    if (deferred_) {
+      position->link_before_self(p);
+      p->size_ = node::pending_bit | 1;
+      return p;
+    }
+    return position->insert_before_self(p);
+  }
+
+  // Unlink 'p' from the sequence, leaving it a singleton; call
+  // 'rebalance_deferred' first
+  void unlink_node(node *p) {
+    if (p == sentinel_.right_) { sentinel_.right_ = inorder_successor(p); }
+    if (p == sentinel_.parent_) { sentinel_.parent_ = inorder_predecessor(p); }
+    p->unlink_self();
+    p->left_ = p->right_ = p->parent_ = nullptr;
+    p->recalculate();
+  }
+
+  void destroy_subtree(node *p) {
+    p->dispose_subtree([this](node *q) { destroy_node(q); });
+  }
+
+  // Bring the tree up to date after the insertions made since rebalancing
+  // was deferred, or since this was last called. The pending nodes form
+  // subtrees hanging from null links of the older nodes, which, without
+  // them, are still a valid tree. Each pending subtree is cut off, rebuilt
+  // perfectly balanced and joined back in at its rank, which takes time
+  // linear in the pending nodes and logarithmic in the size of the tree
+  // for each pending subtree. This is const, since it relinks nodes but
+  // changes neither the sequence nor any iterator.
+  void rebalance_deferred() const noexcept {
+    if (!deferred_ || deferred_->inserted_.empty()) { return; }
+    tree &self = const_cast<tree &>(*this);
+    self.track_stats();
+    auto &nodes = deferred_->inserted_;
+    // Find the roots of the pending subtrees, and replace their sizes by
+    // their ranks among the older nodes before cutting any of them off
+    std::ranges::subrange roots(nodes.begin(),
+      std::ranges::partition(
+        nodes, [](node *p) { return !is_pending(p->parent_); })
+        .begin());
+    for (node *p: roots) { p->size_ = node::pending_bit | older_rank(p); }
+    for (node *p: roots) { owner(p) = nullptr; }
+    // Join them in from the last, so that the ranks of the others hold
+    std::ranges::sort(
+      roots, std::ranges::greater{}, [](node *p) { return p->size_; });
+    node *root = self.sentinel_.left_;
+    for (node *p: roots) {
+      std::size_t rank = p->size_ & ~node::pending_bit;
+      auto [l, r] = node::split_subtree(root, rank);
+      root = node::join_subtrees(
+        node::join_subtrees(l, node::rebuild_subtree(p)), r);
+    }
+    self.sentinel_.attach_root(root);
+    nodes.clear();
+  }
+
+  // True if dropping the allocator releases every node without visiting
+  // them; the node must be trivially destructible, summary and all
+  bool releases_nodes_wholesale() const {
+    if constexpr (std::is_trivially_destructible_v<node> &&
+                  requires(const node_allocator_type &a) { a.sole_owner(); }) {
+      return alloc_.sole_owner();
+    } else {
+      return false;
+    }
+  }
+
+public:
+  // A handle owning a node extracted from a tree, which destroys the node
+  // unless it is inserted into a tree with an equal allocator
+  struct node_type {
+  private:
+    friend struct tree;
+    node *p_{};
+    std::optional<node_allocator_type> alloc_;
+
+    node_type(node *p, const node_allocator_type &alloc): p_(p), alloc_(alloc) {}
+
+  public:
+    using value_type = T;
+    using allocator_type = Allocator;
+
+    node_type() = default;
+
+    node_type(node_type &&other) noexcept:
+        p_(std::exchange(other.p_, nullptr)), alloc_(std::move(other.alloc_)) {
+      other.alloc_.reset();
+    }
+
+    node_type &operator=(node_type &&other) noexcept {
+      if (this != &other) {
+        reset();
+        p_ = std::exchange(other.p_, nullptr);
+        alloc_ = std::move(other.alloc_);
+        other.alloc_.reset();
+      }
+      return *this;
+    }
+
+    ~node_type() { reset(); }
+
+    bool empty() const { return !p_; }
+    explicit operator bool() const { return p_; }
+    T &value() const { return p_->value_; }
+    allocator_type get_allocator() const { return allocator_type(*alloc_); }
+
+  private:
+    void reset() {
+      if (p_) {
+        node_traits::destroy(*alloc_, p_);
+        node_traits::deallocate(*alloc_, p_, 1);
+        p_ = nullptr;
+        alloc_.reset();
+      }
+    }
+  };
+
+  // While an object of this type is alive, 'insert' links new nodes into
+  // the tree without rebalancing; see the comment at the head of this file
+  struct deferred_balance {
+    explicit deferred_balance(tree &t): tree_(t.deferred_ ? nullptr : &t) {
+      if (tree_) { tree_->deferred_ = this; }
+    }
+
+    ~deferred_balance() {
+      if (tree_) {
+        tree_->rebalance_deferred();
+        tree_->deferred_ = nullptr;
+      }
+    }
+
+    deferred_balance(const deferred_balance &) = delete;
+    deferred_balance &operator=(const deferred_balance &) = delete;
+
+  private:
+    friend struct tree;
+    tree *tree_;
+    std::vector<node *> inserted_;
+  };
+
   struct iterator {
   private:
-    friend struct tree<T>;
-    detail::node<T> *p_;
-    iterator(detail::node<T> *p): p_(p) {}
+    friend struct tree;
+    node *p_;
+    iterator(node *p): p_(p) {}
 
   public:
     using difference_type = std::ptrdiff_t;
@@ -86,7 +631,7 @@ public:
     }
 
     iterator operator++(int) {
-      detail::node<T> *oldp = p_;
+      node *oldp = p_;
       p_ = inorder_successor(p_);
       return iterator{oldp};
     }
@@ -97,7 +642,7 @@ public:
     }
 
     iterator operator--(int) {
-      detail::node<T> *oldp = p_;
+      node *oldp = p_;
       p_ = inorder_predecessor(p_);
       return iterator{oldp};
     }
@@ -108,9 +653,9 @@ public:
 
   struct const_iterator {
   private:
-    friend struct tree<T>;
-    const detail::node<T> *p_;
-    const_iterator(const detail::node<T> *p): p_(p) {}
+    friend struct tree;
+    const node *p_;
+    const_iterator(const node *p): p_(p) {}
 
   public:
     using difference_type = std::ptrdiff_t;
@@ -134,7 +679,7 @@ public:
     }
 
     const_iterator operator++(int) {
-      const detail::node<T> *oldp = p_;
+      const node *oldp = p_;
       p_ = inorder_successor(p_);
       return const_iterator{oldp};
     }
@@ -145,7 +690,7 @@ public:
     }
 
     const_iterator operator--(int) {
-      detail::node<T> *oldp = p_;
+      node *oldp = p_;
       p_ = inorder_predecessor(p_);
       return const_iterator{oldp};
     }
@@ -167,52 +712,900 @@ public:
     return b == a;
   }
 
+private:
+  template <bool Const> struct basic_indexed_iterator {
+  private:
+    friend struct tree;
+    using node_pointer =
+      std::conditional_t<Const, const node *, node *>;
+    using base_iterator = std::conditional_t<Const, const_iterator, iterator>;
+    node_pointer p_;
+    basic_indexed_iterator(node_pointer p): p_(p) {}
+
+  public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = std::conditional_t<Const, const T *, T *>;
+    using reference = std::conditional_t<Const, const T &, T &>;
+    using iterator_category = std::random_access_iterator_tag;
+
+    // Singular value required for range iterator
+    basic_indexed_iterator(): p_(nullptr) {}
+
+    // Convert from the wrapped iterator type
+    basic_indexed_iterator(const base_iterator &other): p_(other.p_) {}
+
+    // Convert indexed_iterator to const_indexed_iterator
+    template <bool OtherConst>
+      requires(Const && !OtherConst)
+    basic_indexed_iterator(const basic_indexed_iterator<OtherConst> &other):
+        p_(other.p_) {}
+
+    base_iterator base() const { return base_iterator(p_); }
+
+    reference operator*() const { return p_->value_; }
+    pointer operator->() const { return &p_->value_; }
+    reference operator[](difference_type n) const { return *(*this + n); }
+
+    basic_indexed_iterator &operator++() {
+      p_ = inorder_successor(p_);
+      return *this;
+    }
+
+    basic_indexed_iterator operator++(int) {
+      node_pointer oldp = p_;
+      p_ = inorder_successor(p_);
+      return basic_indexed_iterator{oldp};
+    }
+
+    basic_indexed_iterator &operator--() {
+      p_ = inorder_predecessor(p_);
+      return *this;
+    }
+
+    basic_indexed_iterator operator--(int) {
+      node_pointer oldp = p_;
+      p_ = inorder_predecessor(p_);
+      return basic_indexed_iterator{oldp};
+    }
+
+    basic_indexed_iterator &operator+=(difference_type n) {
+      p_ = const_cast<node_pointer>(advance_node(p_, n));
+      return *this;
+    }
+
+    basic_indexed_iterator &operator-=(difference_type n) {
+      return *this += -n;
+    }
+
+    friend basic_indexed_iterator operator+(
+      basic_indexed_iterator i, difference_type n) {
+      return i += n;
+    }
+
+    friend basic_indexed_iterator operator+(
+      difference_type n, basic_indexed_iterator i) {
+      return i += n;
+    }
+
+    friend basic_indexed_iterator operator-(
+      basic_indexed_iterator i, difference_type n) {
+      return i -= n;
+    }
+
+    friend difference_type operator-(
+      const basic_indexed_iterator &i, const basic_indexed_iterator &j) {
+      return (difference_type)rank_of(i.p_) - (difference_type)rank_of(j.p_);
+    }
+
+    bool operator==(const basic_indexed_iterator &other) const {
+      return p_ == other.p_;
+    }
+
+    std::strong_ordering operator<=>(
+      const basic_indexed_iterator &other) const {
+      return p_ == other.p_ ? std::strong_ordering::equal
+                            : rank_of(p_) <=> rank_of(other.p_);
+    }
+  };
+
+public:
+  using indexed_iterator = basic_indexed_iterator<false>;
+  using const_indexed_iterator = basic_indexed_iterator<true>;
+
+private:
+  // Adopt the detached subtree 'p'
+  tree(node *p, const node_allocator_type &alloc):
+      tree(Allocator(alloc)) {
+    sentinel_.attach_root(p);
+  }
+
+  node *detach_root() {
+    node *p = sentinel_.left_;
+    sentinel_.attach_root(nullptr);
+    return p;
+  }
+
+  // Construct nodes holding copies of '[first, last)' and return them as a
+  // detached, perfectly balanced subtree
+  template <std::input_iterator I, std::sentinel_for<I> S>
+  node *build_nodes(I first, S last) {
+    // Construct the nodes first, chained through 'right_'
+    node *head = nullptr;
+    node **tail = &head;
+    std::size_t count{};
+    try {
+      for (; first != last; ++first) {
+        *tail = create_node(*first);
+        tail = &(*tail)->right_;
+        ++count;
+      }
+    } catch (...) {
+      while (head) {
+        node *next = head->right_;
+        destroy_node(head);
+        head = next;
+      }
+      throw;
+    }
+    return node::build_subtree(count, [&head] {
+      node *p = head;
+      head = head->right_;
+      return p;
+    });
+  }
+
+  // Nodes dropped by the set operations, freed on the calling thread once
+  // the operation is complete, because the allocator may not be thread
+  // safe. The dropped subtrees are chained through their roots' parent
+  // links, so that adding one never allocates and never throws.
+  struct discard_list {
+    std::mutex mutex_;
+    node *head_{};
+
+    void add(node *p) {
+      if (p) {
+        std::lock_guard lock(mutex_);
+        p->parent_ = std::exchange(head_, p);
+      }
+    }
+
+    void destroy_all(tree &t) {
+      while (node *p = head_) {
+        head_ = p->parent_;
+        t.destroy_subtree(p);
+      }
+    }
+  };
+
+  // The parameters of a set operation. If 'cmp' throws, each recursive
+  // call hands the nodes of its arguments, however far it got with them,
+  // to its caller before rethrowing: 'intersect' and 'subtract' discard
+  // them, and 'merge' adds them to 'spilled_' in an order that keeps the
+  // nodes of each argument in their order, so that they can be told apart
+  // and restored by a caller that knows one of the two sets of nodes.
+  // Only the calling thread unwinds, since under a parallel policy 'cmp'
+  // must not throw; the stage a call reached is read only after any
+  // forked thread has been joined.
+  template <typename Comp> struct set_operation {
+    Comp &cmp_;
+    std::size_t grain_;
+    discard_list discarded_;
+    node *spilled_{};
+
+    // Split the detached subtree 'a' into the nodes 'x' before, equivalent
+    // to, and after the value 'k', according to 'cmp(x, k)'; if 'cmp'
+    // throws, 'a' is unchanged
+    std::tuple<node *, node *, node *> partition(node *a, const T &k) {
+      std::size_t i =
+        node::partition_rank(a, [&](const T &x) { return cmp_(x, k) < 0; });
+      std::size_t j =
+        node::partition_rank(a, [&](const T &x) { return cmp_(x, k) <= 0; });
+      auto [am, r] = node::split_subtree(a, j);
+      auto [l, m] = node::split_subtree(am, i);
+      return std::make_tuple(l, m, r);
+    }
+
+    // Run the recursive calls 'left()' and 'right()' on subtrees holding
+    // 'n' nodes, forking while 'depth' is positive, and record in 'stage'
+    // whether 'left()' has started (1) or returned (2)
+    void fork(int depth, std::size_t n, int &stage, auto &&left, auto &&right) {
+      detail::fork_join(
+        depth > 0 && n >= grain_,
+        [&] {
+          stage = 1;
+          left();
+          stage = 2;
+        },
+        right);
+    }
+
+    // Append the detached subtrees 'ps' to 'spilled_', in order
+    void spill(auto... ps) {
+      ((spilled_ = node::join_subtrees(spilled_, ps)), ...);
+    }
+
+    // The elements of both, those of 'a' before those of 'b' where
+    // equivalent
+    node *merge(node *a, node *b, int depth) {
+      if (!a || !b) { return a ? a : b; }
+      std::size_t n = (std::size_t)a->size_ + b->size_;
+      std::size_t i;
+      try {
+        i = node::partition_rank(
+          a, [&](const T &x) { return cmp_(x, b->value_) <= 0; });
+      } catch (...) {
+        spill(a, b);
+        throw;
+      }
+      node *l2 = b->left_, *r2 = b->right_;
+      auto [l1, r1] = node::split_subtree(a, i);
+      node *l, *r;
+      int stage = 0;
+      try {
+        fork(
+          depth, n, stage,
+          [&] { l = merge(l1, l2, depth - 1); },
+          [&] { r = merge(r1, r2, depth - 1); });
+      } catch (...) {
+        // The call that threw has spilled its own arguments
+        if (stage == 0) {
+          spill(l1, r1, node::join_subtrees(l2, b, r2));
+        } else if (stage == 1) {
+          spill(r1, node::join_subtrees(nullptr, b, r2));
+        } else {
+          spilled_ = node::join_subtrees(l, b, spilled_);
+        }
+        throw;
+      }
+      return node::join_subtrees(l, b, r);
+    }
+
+    // The elements of 'a' equivalent to some element of 'b'
+    node *intersect(node *a, node *b, int depth) {
+      if (!a || !b) {
+        discarded_.add(a ? a : b);
+        return nullptr;
+      }
+      std::size_t n = (std::size_t)a->size_ + b->size_;
+      node *l2 = b->left_, *r2 = b->right_;
+      node *l1, *m, *r1;
+      try {
+        std::tie(l1, m, r1) = partition(a, b->value_);
+      } catch (...) {
+        discarded_.add(a);
+        discarded_.add(b);
+        throw;
+      }
+      b->left_ = b->right_ = nullptr;
+      discarded_.add(b);
+      node *l, *r;
+      int stage = 0;
+      try {
+        fork(
+          depth, n, stage,
+          [&] { l = intersect(l1, l2, depth - 1); },
+          [&] { r = intersect(r1, r2, depth - 1); });
+      } catch (...) {
+        // The call that threw has discarded its own arguments
+        discarded_.add(m);
+        if (stage == 0) {
+          discarded_.add(l1);
+          discarded_.add(l2);
+        }
+        if (stage != 2) {
+          discarded_.add(r1);
+          discarded_.add(r2);
+        } else {
+          discarded_.add(l);
+        }
+        throw;
+      }
+      return node::join_subtrees(node::join_subtrees(l, m), r);
+    }
+
+    // The elements of 'a' equivalent to no element of 'b'
+    node *subtract(node *a, node *b, int depth) {
+      if (!a || !b) {
+        discarded_.add(b);
+        return a;
+      }
+      std::size_t n = (std::size_t)a->size_ + b->size_;
+      node *l2 = b->left_, *r2 = b->right_;
+      node *l1, *m, *r1;
+      try {
+        std::tie(l1, m, r1) = partition(a, b->value_);
+      } catch (...) {
+        discarded_.add(a);
+        discarded_.add(b);
+        throw;
+      }
+      b->left_ = b->right_ = nullptr;
+      discarded_.add(b);
+      discarded_.add(m);
+      node *l, *r;
+      int stage = 0;
+      try {
+        fork(
+          depth, n, stage,
+          [&] { l = subtract(l1, l2, depth - 1); },
+          [&] { r = subtract(r1, r2, depth - 1); });
+      } catch (...) {
+        // The call that threw has discarded its own arguments
+        if (stage == 0) {
+          discarded_.add(l1);
+          discarded_.add(l2);
+        }
+        if (stage != 2) {
+          discarded_.add(r1);
+          discarded_.add(r2);
+        } else {
+          discarded_.add(l);
+        }
+        throw;
+      }
+      return node::join_subtrees(l, r);
+    }
+  };
+
+  // Apply the set operation 'op' to the nodes of 'a' and 'b', returning
+  // the result as a new tree and leaving both arguments empty. If 'cmp'
+  // throws, every node of both is destroyed.
+  template <typename Policy, typename Comp, typename Op>
+  static tree combine(
+    const Policy &policy, tree &a, tree &b, Comp &cmp, Op op) {
+    set_operation<Comp> operation{cmp, detail::grain_size(policy)};
+    a.track_stats();
+    a.rebalance_deferred();
+    b.rebalance_deferred();
+    node *p;
+    try {
+      p = (operation.*op)(
+        a.detach_root(), b.detach_root(), detail::fork_depth(policy));
+    } catch (...) {
+      operation.discarded_.add(operation.spilled_);
+      operation.discarded_.destroy_all(a);
+      throw;
+    }
+    operation.discarded_.destroy_all(a);
+    return tree(p, a.alloc_);
+  }
+
+  void append(tree &&other) {
+    track_stats();
+    rebalance_deferred();
+    other.rebalance_deferred();
+    sentinel_.attach_root(node::join_subtrees(
+      detach_root(), other.detach_root()));
+  }
+
+  // Copy the detached subtree 'p' with this tree's allocator, shape and
+  // sizes included, and return the copy's root
+  node *clone_subtree(const node *p) {
+    node *q = create_node(p->value_);
+    q->size_ = p->size_;
+    q->summary_ = p->summary_;
+    try {
+      if (p->left_) {
+        q->left_ = clone_subtree(p->left_);
+        q->left_->parent_ = q;
+      }
+      if (p->right_) {
+        q->right_ = clone_subtree(p->right_);
+        q->right_->parent_ = q;
+      }
+    } catch (...) {
+      destroy_subtree(q);
+      throw;
+    }
+    return q;
+  }
+
+  node *clone_root(const tree &other) {
+    other.rebalance_deferred();
+    const node *p = other.sentinel_.left_;
+    return p ? clone_subtree(p) : nullptr;
+  }
+
+  // The length from which 'reverse' mirrors the range rather than
+  // exchanging its nodes pairwise; the two cost about the same here
+  static constexpr std::size_t reverse_split_threshold = 16384;
+
+  // Take the nodes of 'other', whose allocator is equal to this tree's,
+  // leaving it empty
+  void steal(tree &other) noexcept {
+    other.rebalance_deferred();
+    sentinel_.attach_root(other.detach_root());
+  }
+
 public:
   ~tree() {
-    detail::node<T> *p = sentinel_.left_;
-    if (p) { p->delete_subtree(); }
+    if constexpr (Traits::collect_stats) {
+      if (detail::stats_counters::current == &stats_) {
+        detail::stats_counters::current = nullptr;
+      }
+    }
+    node *p = sentinel_.left_;
+    if (p && !releases_nodes_wholesale()) { destroy_subtree(p); }
   }
 
-  tree() {
-    sentinel_.left_ = nullptr;
-    sentinel_.right_ = nullptr;
-    sentinel_.parent_ = &sentinel_;
+  tree(): tree(Allocator()) {}
+
+  explicit tree(const Allocator &alloc): alloc_(alloc) {
+    sentinel_.size_ = 0;
+    sentinel_.attach_root(nullptr);
   }
 
-  iterator begin() {
-    detail::node<T> *p = &sentinel_;
-    while (p->left_) { p = p->left_; }
-    return iterator{p};
+  tree(const tree &other):
+      tree(Allocator(
+        node_traits::select_on_container_copy_construction(other.alloc_))) {
+    sentinel_.attach_root(clone_root(other));
   }
-  iterator end() { return iterator(&sentinel_); }
-  const_iterator begin() const {
-    const detail::node<T> *p = &sentinel_;
-    while (p->left_) { p = p->left_; }
-    return const_iterator{p};
+
+  // The moved-from tree is left empty, with a copy of the allocator
+  tree(tree &&other) noexcept: tree(Allocator(other.alloc_)) { steal(other); }
+
+  tree &operator=(const tree &other) {
+    if (this != &other) {
+      track_stats();
+      if constexpr (node_traits::propagate_on_container_copy_assignment::
+                      value) {
+        if (alloc_ != other.alloc_) {
+          // The new nodes must come from the new allocator
+          tree copy{Allocator(other.alloc_)};
+          copy.sentinel_.attach_root(copy.clone_root(other));
+          clear();
+          alloc_ = other.alloc_;
+          steal(copy);
+          return *this;
+        }
+      }
+      node *p = clone_root(other);
+      clear();
+      sentinel_.attach_root(p);
+    }
+    return *this;
+  }
+
+  tree &operator=(tree &&other) noexcept(
+    node_traits::propagate_on_container_move_assignment::value ||
+    node_traits::is_always_equal::value) {
+    if (this != &other) {
+      track_stats();
+      clear();
+      if constexpr (node_traits::propagate_on_container_move_assignment::
+                      value) {
+        alloc_ = other.alloc_;
+      } else if constexpr (!node_traits::is_always_equal::value) {
+        if (alloc_ != other.alloc_) {
+          assign(std::make_move_iterator(other.begin()),
+            std::make_move_iterator(other.end()));
+          other.clear();
+          return *this;
+        }
+      }
+      steal(other);
+    }
+    return *this;
+  }
+
+  // Exchange the contents of two trees in constant time; their allocators
+  // are exchanged if they propagate on swap, and must otherwise be equal
+  void swap(tree &other) noexcept {
+    rebalance_deferred();
+    other.rebalance_deferred();
+    node *p = detach_root();
+    sentinel_.attach_root(other.detach_root());
+    other.sentinel_.attach_root(p);
+    if constexpr (node_traits::propagate_on_container_swap::value) {
+      using std::swap;
+      swap(alloc_, other.alloc_);
+    }
+  }
+
+  friend void swap(tree &a, tree &b) noexcept { a.swap(b); }
+
+  // Destroy every element; if the allocator is a pool that this tree alone
+  // owns, release the pool's blocks at once rather than node by node
+  void clear() noexcept {
+    if (deferred_) { deferred_->inserted_.clear(); }
+    node *p = detach_root();
+    if (!p) { return; }
+    if constexpr (requires(node_allocator_type &a) { a.release(); }) {
+      if (releases_nodes_wholesale()) {
+        alloc_.release();
+        return;
+      }
+    }
+    destroy_subtree(p);
+  }
+
+  template <std::input_iterator I, std::sentinel_for<I> S>
+  tree(I first, S last, const Allocator &alloc = Allocator()): tree(alloc) {
+    assign(std::move(first), std::move(last));
+  }
+
+  template <std::input_iterator I, std::sentinel_for<I> S>
+  void assign(I first, S last) {
+    node *p = build_nodes(first, last);
+    if (node *q = sentinel_.left_) { destroy_subtree(q); }
+    if (deferred_) { deferred_->inserted_.clear(); }
+    sentinel_.attach_root(p);
   }
+
+  // Insert copies of the values in '[first, last)', which must be ordered
+  // by the binary comparator 'cmp', each after the elements equivalent to it
+  template <std::input_iterator I, std::sentinel_for<I> S, typename Comp>
+  void insert_sorted(I first, S last, Comp cmp) {
+    insert_sorted(seq, first, last, cmp);
+  }
+
+  template <execution_policy Policy, std::input_iterator I,
+    std::sentinel_for<I> S, typename Comp>
+  void insert_sorted(const Policy &policy, I first, S last, Comp cmp) {
+    node *p = build_nodes(first, last);
+    // Note the new nodes, so that they can be told from the tree's own if
+    // 'cmp' throws
+    std::vector<node *> batch;
+    try {
+      batch.reserve(p ? (std::size_t)p->size_ : 0);
+    } catch (...) {
+      if (p) { destroy_subtree(p); }
+      throw;
+    }
+    auto note = [&batch](auto &self, node *q) -> void {
+      if (q) {
+        self(self, q->left_);
+        batch.push_back(q);
+        self(self, q->right_);
+      }
+    };
+    note(note, p);
+    track_stats();
+    rebalance_deferred();
+    set_operation<Comp> operation{cmp, detail::grain_size(policy)};
+    try {
+      sentinel_.attach_root(
+        operation.merge(detach_root(), p, detail::fork_depth(policy)));
+    } catch (...) {
+      // The spilled nodes keep the tree's order, so the tree is restored
+      // by rebuilding them without the new nodes
+      std::ranges::sort(batch);
+      sentinel_.attach_root(node::rebuild_subtree(operation.spilled_,
+        [this, &batch](node *q) {
+          if (!std::ranges::binary_search(batch, q)) { return true; }
+          destroy_node(q);
+          return false;
+        }));
+      throw;
+    }
+  }
+
+  iterator begin() { return iterator(sentinel_.right_); }
+  iterator end() { return iterator(&sentinel_); }
+  const_iterator begin() const { return const_iterator(sentinel_.right_); }
   const_iterator end() const { return const_iterator(&sentinel_); }
 
-  std::size_t size() const { return empty() ? 0 : sentinel_.left_->size_; }
+  std::ranges::subrange<indexed_iterator> indexed() {
+    return {indexed_iterator(begin()), indexed_iterator(end())};
+  }
+  std::ranges::subrange<const_indexed_iterator> indexed() const {
+    return {const_indexed_iterator(begin()), const_indexed_iterator(end())};
+  }
+
+  allocator_type get_allocator() const { return allocator_type(alloc_); }
+
+  std::size_t size() const {
+    const node *p = sentinel_.left_;
+    std::size_t n = !p || is_pending(p) ? 0 : p->size_;
+    return deferred_ ? n + deferred_->inserted_.size() : n;
+  }
 
   bool empty() const { return !sentinel_.left_; }
 
+  // The number of elements is limited by the allocator's 'size_type', less
+  // the top bit, which marks the nodes pending under a 'deferred_balance'
+  std::size_t max_size() const {
+    return (std::min)((std::size_t)(node::pending_bit - 1),
+      (std::size_t)node_traits::max_size(alloc_));
+  }
+
   template <typename U> iterator insert(iterator position, U &&value) {
-    return iterator(position.p_->insert_before_self((U &&)value));
+    return emplace(position, (U &&)value);
+  }
+
+  // Insert 'T(args...)' before 'position' and return an iterator to it
+  template <typename... Args>
+  iterator emplace(iterator position, Args &&...args) {
+    node *p = create_node((Args &&)args...);
+    track_stats();
+    try {
+      record_inserted(p);
+    } catch (...) {
+      destroy_node(p);
+      throw;
+    }
+    return iterator(link_node(position.p_, p));
+  }
+
+  // Insert the node owned by 'handle', if any, before 'position', and
+  // return an iterator to it, or 'end()' if 'handle' is empty
+  iterator insert(iterator position, node_type &&handle) {
+    if (handle.empty()) { return end(); }
+    track_stats();
+    record_inserted(handle.p_);
+    node *p = std::exchange(handle.p_, nullptr);
+    handle.alloc_.reset();
+    // The value may have been modified through the handle
+    p->recalculate_summary();
+    return iterator(link_node(position.p_, p));
   }
 
   iterator erase(iterator position) {
-    iterator result(inorder_successor(position.p_));
-    position.p_->erase_self();
+    track_stats();
+    node *p = position.p_;
+    iterator result(inorder_successor(p));
+    rebalance_deferred();
+    unlink_node(p);
+    destroy_node(p);
+    return result;
+  }
+
+  // Unlink the element at 'position' and return a handle owning it
+  node_type extract(iterator position) {
+    track_stats();
+    node_type result(position.p_, alloc_);
+    rebalance_deferred();
+    unlink_node(position.p_);
+    return result;
+  }
+
+  // Move the element at 'from' to just before 'to', relinking its node
+  void relocate(iterator from, iterator to) {
+    node *p = from.p_;
+    if (p == to.p_ || inorder_successor(p) == to.p_) { return; }
+    track_stats();
+    rebalance_deferred();
+    record_inserted(p);
+    unlink_node(p);
+    link_node(to.p_, p);
+  }
+
+  iterator erase(iterator first, iterator last) {
+    if (first != last) {
+      track_stats();
+      rebalance_deferred();
+      std::size_t i = rank_of(first.p_);
+      std::size_t j = rank_of(last.p_);
+      auto [l, r] = node::split_subtree(detach_root(), j);
+      auto [ll, lr] = node::split_subtree(l, i);
+      destroy_subtree(lr);
+      sentinel_.attach_root(node::join_subtrees(ll, r));
+    }
+    return last;
+  }
+
+  void reverse(iterator first, iterator last) {
+    track_stats();
+    rebalance_deferred();
+    std::size_t i = rank_of(first.p_), j = rank_of(last.p_);
+    if (j - i < 2) { return; }
+    if (j - i < reverse_split_threshold) {
+      // Exchange nodes pairwise from the ends inward, which avoids the
+      // cost of the splits and joins
+      node *p = first.p_, *q = inorder_predecessor(last.p_);
+      for (std::size_t m = (j - i) / 2; m; --m) {
+        node *next_p = inorder_successor(p), *next_q = inorder_predecessor(q);
+        exchange_elements(iterator(p), iterator(q));
+        p = next_p;
+        q = next_q;
+      }
+    } else {
+      auto [l, r] = node::split_subtree(detach_root(), j);
+      auto [ll, lr] = node::split_subtree(l, i);
+      node::mirror_subtree(lr);
+      sentinel_.attach_root(node::join_subtrees(node::join_subtrees(ll, lr), r));
+    }
+  }
+
+  void exchange_ranges(iterator a_first, iterator a_last, iterator b_first,
+    iterator b_last) {
+    track_stats();
+    rebalance_deferred();
+    std::size_t i = rank_of(a_first.p_), j = rank_of(a_last.p_);
+    std::size_t k = rank_of(b_first.p_), l = rank_of(b_last.p_);
+    if (k < i) {
+      std::swap(i, k);
+      std::swap(j, l);
+    }
+    // Cut the sequence into 'head, a, middle, b, tail' and rejoin it as
+    // 'head, b, middle, a, tail'
+    auto [t1, tail] = node::split_subtree(detach_root(), l);
+    auto [t2, b] = node::split_subtree(t1, k);
+    auto [t3, middle] = node::split_subtree(t2, j);
+    auto [head, a] = node::split_subtree(t3, i);
+    node *p = node::join_subtrees(head, b);
+    p = node::join_subtrees(p, middle);
+    p = node::join_subtrees(p, a);
+    sentinel_.attach_root(node::join_subtrees(p, tail));
+  }
+
+  iterator nth(std::size_t index) {
+    rebalance_deferred();
+    if (index < size()) {
+      return iterator(nth_node(sentinel_.left_, index));
+    } else {
+      return end();
+    }
+  }
+
+  const_iterator nth(std::size_t index) const {
+    return const_cast<tree *>(this)->nth(index);
+  }
+
+  std::size_t rank(const_iterator i) const {
+    rebalance_deferred();
+    return rank_of(i.p_);
+  }
+
+  std::ptrdiff_t distance(const_iterator i, const_iterator j) const {
+    rebalance_deferred();
+    return (std::ptrdiff_t)rank_of(j.p_) - (std::ptrdiff_t)rank_of(i.p_);
+  }
+
+  // Return the summary of the elements in '[first, last)', or of the whole
+  // tree, combined in order
+  summary_type aggregate(const_iterator first, const_iterator last) const
+    requires(node::augmented)
+  {
+    rebalance_deferred();
+    std::size_t i = rank_of(first.p_);
+    std::size_t j = rank_of(last.p_);
+    if (i == j) { return Traits::augmentation::identity(); }
+    return node::summarize(sentinel_.left_, i, j);
+  }
+
+  summary_type aggregate() const
+    requires(node::augmented)
+  {
+    rebalance_deferred();
+    if (!sentinel_.left_) { return Traits::augmentation::identity(); }
+    return sentinel_.left_->summary_;
+  }
+
+  // Recalculate the summaries that depend on the element at 'position',
+  // after it has been modified in place
+  void refresh(iterator position)
+    requires(node::augmented)
+  {
+    rebalance_deferred();
+    position.p_->recalculate_summaries_above();
+  }
+
+  // Call 'f(x)' for each element 'x' in '[first, last)', or in the whole
+  // tree, in order
+  template <typename F> void for_each(iterator first, iterator last, F f) {
+    rebalance_deferred();
+    for_each_span(first.p_, rank_of(last.p_) - rank_of(first.p_), f);
+  }
+
+  template <typename F>
+  void for_each(const_iterator first, const_iterator last, F f) const {
+    rebalance_deferred();
+    for_each_span(first.p_, rank_of(last.p_) - rank_of(first.p_), f);
+  }
+
+  template <typename F> void for_each(F f) {
+    std::size_t count = size();
+    for_each_in_subtree(sentinel_.left_, count, f);
+  }
+
+  template <typename F> void for_each(F f) const {
+    std::size_t count = size();
+    for_each_in_subtree((const node *)sentinel_.left_, count, f);
+  }
+
+  // Copy the elements in order to 'out' and return the end of the output
+  template <typename O> O copy_to(O out) const {
+    for_each([&out](const T &x) {
+      *out = x;
+      ++out;
+    });
+    return out;
+  }
+
+  void exchange_elements(iterator i, iterator j) {
+    rebalance_deferred();
+    sentinel_.exchange_in_tree(i.p_, j.p_);
+  }
+
+  tree split(iterator position) {
+    track_stats();
+    rebalance_deferred();
+    std::size_t count = rank_of(position.p_);
+    auto [l, r] = node::split_subtree(detach_root(), count);
+    sentinel_.attach_root(l);
+    return tree(r, alloc_);
+  }
+
+  friend tree join(tree &&left, tree &&right) {
+    left.append(std::move(right));
+    return tree(left.detach_root(), left.alloc_);
+  }
+
+  // Join-based set operations; see the comment at the head of this file
+  template <typename Comp> friend tree merge(tree &&a, tree &&b, Comp cmp) {
+    return merge(seq, std::move(a), std::move(b), cmp);
+  }
+
+  template <execution_policy Policy, typename Comp>
+  friend tree merge(const Policy &policy, tree &&a, tree &&b, Comp cmp) {
+    return combine(policy, a, b, cmp, &set_operation<Comp>::merge);
+  }
+
+  template <typename Comp>
+  friend tree intersection(tree &&a, tree &&b, Comp cmp) {
+    return intersection(seq, std::move(a), std::move(b), cmp);
+  }
+
+  template <execution_policy Policy, typename Comp>
+  friend tree intersection(
+    const Policy &policy, tree &&a, tree &&b, Comp cmp) {
+    return combine(policy, a, b, cmp, &set_operation<Comp>::intersect);
+  }
+
+  template <typename Comp>
+  friend tree difference(tree &&a, tree &&b, Comp cmp) {
+    return difference(seq, std::move(a), std::move(b), cmp);
+  }
+
+  template <execution_policy Policy, typename Comp>
+  friend tree difference(const Policy &policy, tree &&a, tree &&b, Comp cmp) {
+    return combine(policy, a, b, cmp, &set_operation<Comp>::subtract);
+  }
+
+  void splice(iterator position, tree &&other) {
+    track_stats();
+    rebalance_deferred();
+    other.rebalance_deferred();
+    std::size_t count = rank_of(position.p_);
+    auto [l, r] = node::split_subtree(detach_root(), count);
+    l = node::join_subtrees(l, other.detach_root());
+    sentinel_.attach_root(node::join_subtrees(l, r));
+  }
+
+  // Return a snapshot of the statistics, if the traits enable them; this
+  // takes time linear in the size of the tree, to measure its shape
+  tree_stats stats() const
+    requires(Traits::collect_stats)
+  {
+    rebalance_deferred();
+    tree_stats result{stats_.single_rotations, stats_.double_rotations,
+      stats_.rebalances, stats_.rebalance_nodes, stats_.searches,
+      stats_.comparisons, stats_.allocations, stats_.deallocations, 0, {}};
+    count_depths(sentinel_.left_, 0, result.depth_histogram);
+    result.height = result.depth_histogram.size();
     return result;
   }
 
-  void exchange_elements(iterator i, iterator j) { exchange_nodes(i.p_, j.p_); }
+  // Reset the statistics counters to zero
+  void reset_stats()
+    requires(Traits::collect_stats)
+  {
+    stats_ = {};
+  }
+
+  // Check the tree's structural invariants in linear time, for testing
+  bool valid() const {
+    rebalance_deferred();
+    return sentinel_.valid_tree();
+  }
 
   // Return an iterator to the first element 'x' in the tree which satisfies
   // 'cmp(x) >= 0', or if no such element exists, the past-the-end sentinel
   template <typename Comp> iterator lower_bound(Comp &&cmp) {
-    if (detail::node<T> *p = sentinel_.left_) {
-      return iterator(lower_bound_node(p, (Comp &&)cmp));
+    if (node *p = sentinel_.left_) {
+      return iterator(lower_bound_node(p, counted((Comp &&)cmp)));
     } else {
       return iterator(&sentinel_);
     }
@@ -221,8 +1614,8 @@ public:
   // Return an iterator to the first element 'x' in the tree which satisfies
   // 'cmp(x) > 0', or if no such element exists, the past-the-end sentinel
   template <typename Comp> iterator upper_bound(Comp &&cmp) {
-    if (detail::node<T> *p = sentinel_.left_) {
-      return iterator(upper_bound_node(p, (Comp &&)cmp));
+    if (node *p = sentinel_.left_) {
+      return iterator(upper_bound_node(p, counted((Comp &&)cmp)));
     } else {
       return iterator(&sentinel_);
     }
@@ -232,8 +1625,8 @@ public:
   // 'cmp(x) == 0'
   template <typename Comp>
   std::tuple<iterator, iterator> equal_range(Comp &&cmp) {
-    if (detail::node<T> *p = sentinel_.left_) {
-      auto [l, r] = equal_range_nodes(p, (Comp &&)cmp);
+    if (node *p = sentinel_.left_) {
+      auto [l, r] = equal_range_nodes(p, counted((Comp &&)cmp));
       return std::make_tuple(iterator(l), iterator(r));
     } else {
       return std::make_tuple(iterator(&sentinel_), iterator(&sentinel_));
@@ -245,16 +1638,74 @@ public:
   // with respect to both comparators
   template <typename LComp, typename RComp>
   std::tuple<iterator, iterator> range_between(LComp &&lcmp, RComp &&rcmp) {
-    if (detail::node<T> *p = sentinel_.left_) {
-      auto [l, r] = range_between_nodes(p, (LComp &&)lcmp, (RComp &&)rcmp);
+    if (node *p = sentinel_.left_) {
+      auto [l, r] = range_between_nodes(
+        p, counted((LComp &&)lcmp), counted((RComp &&)rcmp));
       return std::make_tuple(iterator(l), iterator(r));
     } else {
       return std::make_tuple(iterator(&sentinel_), iterator(&sentinel_));
     }
   }
+
+  // For each comparator 'cmp' in '[first, last)', in order, write
+  // 'lower_bound(cmp)' to 'out'; return the final value of 'out'
+  template <std::forward_iterator I, std::sentinel_for<I> S,
+    std::output_iterator<iterator> O>
+  O lower_bounds(I first, S last, O out) {
+    lower_bounds_nodes(sentinel_.left_, &sentinel_, std::move(first),
+      std::move(last), [&out](node *p) { *out++ = iterator(p); });
+    return out;
+  }
+
+  // For each comparator 'cmp' in '[first, last)', in order, write
+  // 'equal_range(cmp)' to 'out'; return the final value of 'out'
+  template <std::forward_iterator I, std::sentinel_for<I> S,
+    std::output_iterator<std::tuple<iterator, iterator>> O>
+  O equal_ranges(I first, S last, O out) {
+    equal_ranges_nodes(sentinel_.left_, &sentinel_, std::move(first),
+      std::move(last), [&out](node *l, node *r) {
+        *out++ = std::make_tuple(iterator(l), iterator(r));
+      });
+    return out;
+  }
+
+  // Finger search: the same as 'lower_bound(cmp)', but searching outwards
+  // from 'hint', in time logarithmic in the distance from 'hint' to the result
+  template <typename Comp> iterator lower_bound(iterator hint, Comp &&cmp) {
+    auto &&c = counted((Comp &&)cmp);
+    return iterator(
+      finger_bound_node(hint.p_, [&c](const T &x) { return c(x) < 0; }));
+  }
+
+  // Finger search: the same as 'upper_bound(cmp)', but searching outwards
+  // from 'hint', in time logarithmic in the distance from 'hint' to the result
+  template <typename Comp> iterator upper_bound(iterator hint, Comp &&cmp) {
+    auto &&c = counted((Comp &&)cmp);
+    return iterator(
+      finger_bound_node(hint.p_, [&c](const T &x) { return c(x) <= 0; }));
+  }
+
+  // Finger search: the same as 'equal_range(cmp)', but searching outwards
+  // from 'hint' for the start of the range and from there for its end
+  template <typename Comp>
+  std::tuple<iterator, iterator> equal_range(iterator hint, Comp &&cmp) {
+    iterator l = lower_bound(hint, cmp);
+    return std::make_tuple(l, upper_bound(l, (Comp &&)cmp));
+  }
+
+  // Finger search: the same as 'range_between(lcmp, rcmp)', but searching
+  // outwards from 'hint' for the start of the range and from there for its end
+  template <typename LComp, typename RComp>
+  std::tuple<iterator, iterator> range_between(
+    iterator hint, LComp &&lcmp, RComp &&rcmp) {
+    iterator l = lower_bound(hint, (LComp &&)lcmp);
+    return std::make_tuple(l, upper_bound(l, (RComp &&)rcmp));
+  }
 };
 
 static_assert(std::bidirectional_iterator<tree<int>::iterator>);
 static_assert(std::bidirectional_iterator<tree<int>::const_iterator>);
+static_assert(std::random_access_iterator<tree<int>::indexed_iterator>);
+static_assert(std::random_access_iterator<tree<int>::const_indexed_iterator>);
 
 }
@@ -1,8 +1,30 @@
+#include <wb/block_tree.hpp>
+#include <wb/concurrent_tree.hpp>
+#include <wb/frozen_tree.hpp>
+#include <wb/image.hpp>
+#include <wb/intrusive_tree.hpp>
+#include <wb/parallel.hpp>
+#include <wb/persistent_tree.hpp>
+#include <wb/pool.hpp>
+#include <wb/sweep.hpp>
 #include <wb/tree.hpp>
 #include <xoshiro256starstar/xoshiro256starstar.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <forward_list>
 #include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <ratio>
+#include <ranges>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 
 template <typename T> struct cmp {
   T a;
@@ -11,8 +33,76 @@ template <typename T> struct cmp {
 
 template <typename T> cmp<T> make_cmp(T a) { return cmp<T>{a}; }
 
+// The same comparison returning an int, which the searches do not treat as
+// a candidate for their branch-free descent
+template <typename T> struct int_cmp {
+  T a;
+  int operator()(const T &x) const { return (a < x) - (x < a); }
+};
+
+static_assert(wb::detail::three_way_comparator<cmp<float>, float>);
+static_assert(!wb::detail::three_way_comparator<int_cmp<float>, float>);
+
+// Compact nodes for 4-byte values take 32 bytes on 64-bit targets
+static_assert(sizeof(void *) != 8 ||
+              sizeof(wb::detail::node<float, std::uint32_t>) == 32);
+
+// Blocks of floats fill nodes of two cache lines on 64-bit targets
+static_assert(
+  sizeof(void *) != 8 || wb::detail::default_block_size<float> == 22);
+
+// The sum, the minimum and the first of a range of ints, whose combination
+// is not commutative
+struct range_summary {
+  long long sum;
+  int min;
+  int first;
+  bool empty;
+  bool operator==(const range_summary &) const = default;
+};
+
+struct range_augmentation {
+  using value_type = range_summary;
+  static range_summary identity() {
+    return {0, std::numeric_limits<int>::max(), 0, true};
+  }
+  static range_summary lift(int x) { return {x, x, x, false}; }
+  static range_summary combine(
+    const range_summary &a, const range_summary &b) {
+    if (a.empty) { return b; }
+    if (b.empty) { return a; }
+    return {a.sum + b.sum, (std::min)(a.min, b.min), a.first, false};
+  }
+};
+
+struct augmented_traits: wb::tree_traits {
+  using augmentation = range_augmentation;
+};
+
+struct stats_augmented_traits: augmented_traits {
+  static constexpr bool collect_stats = true;
+};
+
+// The elements of a range, in order: a summary that owns heap memory
+struct listing_augmentation {
+  using value_type = std::vector<int>;
+  static std::vector<int> identity() { return {}; }
+  static std::vector<int> lift(int x) { return {x}; }
+  static std::vector<int> combine(
+    const std::vector<int> &a, const std::vector<int> &b) {
+    std::vector<int> result(a);
+    result.insert(result.end(), b.begin(), b.end());
+    return result;
+  }
+};
+
+struct listing_traits: wb::tree_traits {
+  using augmentation = listing_augmentation;
+};
+
 // Iterate from beginning to end
-template <typename T> bool verify_size(const wb::tree<T> &dictionary) {
+template <typename T, typename A, typename R>
+bool verify_size(const wb::tree<T, A, R> &dictionary) {
   std::size_t count{};
   for (auto iter = dictionary.begin(); iter != dictionary.end(); ++iter) {
     ++count;
@@ -23,11 +113,22 @@ template <typename T> bool verify_size(const wb::tree<T> &dictionary) {
       (int)dictionary.size());
     return false;
   }
+  // Check sizes, balance and the cached first and last elements
+  if (!dictionary.valid()) {
+    std::printf("Tree structure test failed\n");
+    return false;
+  }
   // Check that prev(begin) == end
   if (auto prev = std::prev(dictionary.begin()); prev != dictionary.end()) {
     std::printf("Tree iterator circularity test failed\n");
     return false;
   }
+  // Check that next(prev(end)) == end
+  if (!dictionary.empty() &&
+      std::next(std::prev(dictionary.end())) != dictionary.end()) {
+    std::printf("Tree iterator end test failed\n");
+    return false;
+  }
   // Check that prev(next(iter)) == iter
   for (auto iter = dictionary.begin(); iter != dictionary.end(); ++iter) {
     if (std::prev(std::next(iter)) != iter) {
@@ -38,7 +139,7 @@ template <typename T> bool verify_size(const wb::tree<T> &dictionary) {
   return true;
 }
 
-bool test_small_trees() {
+template <typename Tree> bool test_small_trees() {
   // For each small tree, can iterate from beginning to end,
   // exchange any pair of items, erase any single item, then iterate again
   for (std::size_t size = 1; size != 7; ++size) {
@@ -47,7 +148,7 @@ bool test_small_trees() {
         if (size == 1 || i != j) {
           for (int pattern = 0; pattern != 1 << size; ++pattern) {
             for (std::size_t k = 0; k != size; ++k) {
-              wb::tree<int> dictionary;
+              Tree dictionary;
               // Insert items according to pattern
               for (std::size_t l = 0; l != size; ++l) {
                 if ((pattern >> l) & 1) {
@@ -131,17 +232,1754 @@ bool test_range_between(auto &urbg, bool do_shuffle) {
   return ok;
 }
 
+bool test_pool_allocator() {
+  std::printf("Test pool_allocator\n");
+  bool ok = true;
+  wb::tree<int, wb::pool_allocator<int, 8>> dictionary;
+  for (int i = 0; i != 100; ++i) { dictionary.insert(dictionary.end(), i); }
+  // An erased node is reused by the next insertion
+  auto iter = std::next(dictionary.begin(), 50);
+  int *erased = &*iter;
+  iter = dictionary.erase(iter);
+  int *inserted = &*dictionary.insert(iter, -1);
+  if (inserted != erased) {
+    ok = false;
+    std::printf("  erased node was not reused\n");
+  }
+  // Trees sharing a pool may outlive each other
+  auto shared = std::make_unique<wb::tree<int, wb::pool_allocator<int, 8>>>(
+    dictionary.get_allocator());
+  for (int i = 0; i != 100; ++i) { shared->insert(shared->begin(), i); }
+  if (!verify_size(*shared) || !verify_size(dictionary)) { ok = false; }
+  // Nodes whose summaries own memory are destroyed one by one, even though
+  // the values are trivially destructible (a leak shows under ASan)
+  {
+    using listing_tree =
+      wb::tree<int, wb::pool_allocator<int, 8>, listing_traits>;
+    std::vector<int> model(100);
+    std::iota(model.begin(), model.end(), 0);
+    listing_tree listed(model.begin(), model.end());
+    listed.clear();
+    for (int i: model) { listed.insert(listed.end(), i); }
+    if (listed.aggregate() != model) {
+      ok = false;
+      std::printf("  listing summary is wrong\n");
+    }
+  }
+  return ok;
+}
+
+bool test_assign() {
+  std::printf("Test assign\n");
+  bool ok = true;
+  for (int size = 0; size != 100; ++size) {
+    std::vector<int> values(size);
+    std::iota(values.begin(), values.end(), 0);
+    wb::tree<int> dictionary(values.begin(), values.end());
+    if (!verify_size(dictionary) || dictionary.size() != values.size() ||
+        !std::ranges::equal(dictionary, values)) {
+      ok = false;
+      std::printf("  construction from %d values failed\n", size);
+    }
+    // The built tree supports search, insertion and erasure
+    for (int value = 0; value != size; ++value) {
+      auto iter = dictionary.lower_bound(make_cmp(value));
+      if (iter == dictionary.end() || *iter != value) {
+        ok = false;
+        std::printf("  lower_bound(%d) failed in tree of size %d\n", value,
+          size);
+      }
+    }
+    for (int value = 0; value != size; ++value) {
+      auto iter = dictionary.upper_bound(make_cmp(value));
+      dictionary.insert(iter, value);
+    }
+    while (!dictionary.empty() && dictionary.size() > values.size() / 2) {
+      dictionary.erase(std::next(dictionary.begin(), dictionary.size() / 3));
+    }
+    if (!verify_size(dictionary) || !items_are_in_ascending_order(dictionary)) {
+      ok = false;
+      std::printf("  modification after construction failed\n");
+    }
+    // Assignment replaces the contents
+    dictionary.assign(values.rbegin(), values.rend());
+    if (!verify_size(dictionary) ||
+        !std::ranges::equal(dictionary, std::views::reverse(values))) {
+      ok = false;
+      std::printf("  assign of %d values failed\n", size);
+    }
+  }
+  return ok;
+}
+
+bool test_reverse(auto &urbg) {
+  std::printf("Test reverse, exchange_ranges\n");
+  bool ok = true;
+  using augmented_tree = wb::tree<int, std::allocator<int>, augmented_traits>;
+  std::vector<int> model(500);
+  std::iota(model.begin(), model.end(), 0);
+  augmented_tree dictionary(model.begin(), model.end());
+  std::vector<augmented_tree::iterator> iters;
+  for (auto i = dictionary.begin(); i != dictionary.end(); ++i) {
+    iters.push_back(i);
+  }
+  auto index = [&](std::size_t n) {
+    return std::uniform_int_distribution<std::size_t>(0, n)(urbg);
+  };
+  for (int round = 0; ok && round != 1000; ++round) {
+    std::size_t n = model.size();
+    std::size_t i = index(n), j = index(n);
+    if (i > j) { std::swap(i, j); }
+    if (round % 2) {
+      dictionary.reverse(dictionary.nth(i), dictionary.nth(j));
+      std::reverse(model.begin() + i, model.begin() + j);
+    } else {
+      std::size_t k = index(n), l = index(n);
+      if (k > l) { std::swap(k, l); }
+      // Make '[i, j)' and '[k, l)' disjoint, in either order
+      if (j > k && i < l) { continue; }
+      dictionary.exchange_ranges(dictionary.nth(i), dictionary.nth(j),
+        dictionary.nth(k), dictionary.nth(l));
+      if (k < i) {
+        std::swap(i, k);
+        std::swap(j, l);
+      }
+      std::vector<int> exchanged(model.begin(), model.begin() + i);
+      for (auto [from, to]: {std::pair(k, l), std::pair(j, k), std::pair(i, j),
+             std::pair(l, n)}) {
+        exchanged.insert(
+          exchanged.end(), model.begin() + from, model.begin() + to);
+      }
+      model = exchanged;
+    }
+    // Iterators follow the elements
+    if (!dictionary.valid() || !std::ranges::equal(dictionary, model) ||
+        *iters[model[i % n]] != model[i % n] ||
+        dictionary.rank(iters[model[i % n]]) != i % n) {
+      ok = false;
+      std::printf("  round %d failed\n", round);
+    }
+  }
+  if (ok &&
+      dictionary.aggregate(dictionary.nth(10), dictionary.nth(20)).first !=
+        model[10]) {
+    ok = false;
+    std::printf("  aggregate after reverse failed\n");
+  }
+  // Long ranges are mirrored rather than exchanged pairwise
+  std::vector<int> long_model(40000);
+  std::iota(long_model.begin(), long_model.end(), 0);
+  augmented_tree long_dictionary(long_model.begin(), long_model.end());
+  auto kept = long_dictionary.nth(200);
+  long_dictionary.reverse(long_dictionary.nth(100), long_dictionary.nth(39900));
+  std::reverse(long_model.begin() + 100, long_model.begin() + 39900);
+  if (ok && (!long_dictionary.valid() ||
+              !std::ranges::equal(long_dictionary, long_model) ||
+              long_dictionary.rank(kept) != 39799)) {
+    ok = false;
+    std::printf("  reverse of a long range failed\n");
+  }
+  return ok;
+}
+
+bool test_copy_move(auto &urbg) {
+  std::printf("Test copy, move, swap, clear\n");
+  bool ok = true;
+  auto fail = [&ok](const char *what) {
+    ok = false;
+    std::printf("  %s failed\n", what);
+  };
+  wb::tree<int> original;
+  std::vector<int> model;
+  for (int i = 0; i != 1000; ++i) {
+    std::size_t j =
+      std::uniform_int_distribution<std::size_t>(0, model.size())(urbg);
+    original.insert(original.nth(j), i);
+    model.insert(model.begin() + j, i);
+  }
+  // A copy has the same shape and is independent of the original
+  wb::tree<int> copy(original);
+  if (!copy.valid() || !std::ranges::equal(copy, model)) { fail("copy"); }
+  for (std::size_t i = 0; i < model.size(); i += 97) {
+    if (&*copy.nth(i) == &*original.nth(i)) {
+      fail("copy independence");
+      break;
+    }
+  }
+  *copy.begin() = -1;
+  if (*original.begin() != model.front()) { fail("copy independence"); }
+  copy = original;
+  const auto &self = copy;
+  copy = self;
+  if (!copy.valid() || !std::ranges::equal(copy, model)) {
+    fail("copy assignment");
+  }
+  // Moving keeps the nodes, so iterators follow them to the new tree
+  auto middle = original.nth(500);
+  wb::tree<int> moved(std::move(original));
+  if (!moved.valid() || !original.valid() || !original.empty() ||
+      moved.rank(middle) != 500 || !std::ranges::equal(moved, model)) {
+    fail("move constructor");
+  }
+  original.insert(original.end(), 1);
+  original = std::move(moved);
+  if (!original.valid() || !moved.empty() || original.rank(middle) != 500 ||
+      !std::ranges::equal(original, model)) {
+    fail("move assignment");
+  }
+  wb::tree<int> small(model.begin(), model.begin() + 10);
+  swap(small, original);
+  if (!small.valid() || !original.valid() || small.size() != 1000 ||
+      original.size() != 10 || small.rank(middle) != 500 ||
+      std::next(original.begin(), 10) != original.end()) {
+    fail("swap");
+  }
+  // Trees can be held by value in a vector that reallocates
+  std::vector<wb::tree<int>> trees;
+  for (int i = 0; i != 20; ++i) {
+    trees.emplace_back(model.begin(), model.begin() + i);
+  }
+  for (int i = 0; i != 20; ++i) {
+    if (!trees[i].valid() || trees[i].size() != (std::size_t)i) {
+      fail("vector of trees");
+      break;
+    }
+  }
+  small.clear();
+  if (!small.valid() || !small.empty()) { fail("clear"); }
+  // A sole owner of a pool releases its nodes wholesale
+  using pool_tree =
+    wb::tree<int, wb::pool_allocator<int, 8>, wb::stats_tree_traits>;
+  pool_tree pooled(model.begin(), model.end());
+  pool_tree pooled_copy = pooled;
+  pooled.clear();
+  pooled.insert(pooled.end(), 1);
+  pool_tree sole(model.begin(), model.end());
+  sole.clear();
+  sole.insert(sole.end(), 1);
+  if (pooled.stats().deallocations != model.size() ||
+      sole.stats().deallocations != 0 || !sole.valid() || sole.size() != 1 ||
+      !std::ranges::equal(pooled_copy, model)) {
+    fail("clear with pool_allocator");
+  }
+  // Copying an augmented tree keeps its summaries
+  using augmented_tree = wb::tree<int, std::allocator<int>, augmented_traits>;
+  augmented_tree augmented(model.begin(), model.end());
+  augmented_tree augmented_copy(augmented);
+  if (!augmented_copy.valid() ||
+      augmented_copy.aggregate() != augmented.aggregate()) {
+    fail("augmented copy");
+  }
+  return ok;
+}
+
+bool test_split_join(auto &urbg) {
+  std::printf("Test split, join, splice\n");
+  bool ok = true;
+  for (int round = 0; round != 200; ++round) {
+    // Build two trees of random (possibly very different) sizes
+    std::size_t size_a = std::uniform_int_distribution<std::size_t>(0, 300)(urbg);
+    std::size_t size_b = round % 2 ? size_a * 7 + 1 : round % 5;
+    std::vector<int> model_a(size_a), model_b(size_b);
+    std::iota(model_a.begin(), model_a.end(), 0);
+    std::iota(model_b.begin(), model_b.end(), 1000);
+    wb::tree<int> a(model_a.begin(), model_a.end());
+    wb::tree<int> b;
+    for (int value: model_b) { b.insert(b.end(), value); }
+
+    // Split 'a' at a random position
+    std::size_t k = std::uniform_int_distribution<std::size_t>(0, size_a)(urbg);
+    wb::tree<int> c = a.split(std::next(a.begin(), k));
+    if (!a.valid() || !c.valid() || a.size() != k ||
+        !std::ranges::equal(a, std::views::take(model_a, k)) ||
+        !std::ranges::equal(c, std::views::drop(model_a, k))) {
+      ok = false;
+      std::printf("  split of %d at %d failed\n", (int)size_a, (int)k);
+    }
+
+    // Join the pieces back together
+    wb::tree<int> d = join(std::move(a), std::move(c));
+    if (!a.empty() || !c.empty() || !d.valid() || !verify_size(d) ||
+        !std::ranges::equal(d, model_a)) {
+      ok = false;
+      std::printf("  join of %d and %d failed\n", (int)k, (int)(size_a - k));
+    }
+
+    // Splice 'b' into 'd' at a random position
+    auto first_b = b.begin();
+    std::size_t j = std::uniform_int_distribution<std::size_t>(0, size_a)(urbg);
+    d.splice(std::next(d.begin(), j), std::move(b));
+    model_a.insert(model_a.begin() + j, model_b.begin(), model_b.end());
+    if (!b.empty() || !d.valid() || !verify_size(d) ||
+        !std::ranges::equal(d, model_a) ||
+        (size_b && std::distance(d.begin(), first_b) != (std::ptrdiff_t)j)) {
+      ok = false;
+      std::printf("  splice of %d into %d at %d failed\n", (int)size_b,
+        (int)size_a, (int)j);
+    }
+  }
+  return ok;
+}
+
+bool test_erase_range(auto &urbg) {
+  std::printf("Test erase range\n");
+  bool ok = true;
+  for (int round = 0; round != 200; ++round) {
+    std::size_t size = std::uniform_int_distribution<std::size_t>(0, 500)(urbg);
+    std::vector<int> model(size);
+    std::iota(model.begin(), model.end(), 0);
+    wb::tree<int, wb::pool_allocator<int>> dictionary(model.begin(), model.end());
+    while (!model.empty()) {
+      std::uniform_int_distribution<std::size_t> dist(0, model.size());
+      std::size_t i = dist(urbg), j = dist(urbg);
+      if (i > j) { std::swap(i, j); }
+      auto last = std::next(dictionary.begin(), j);
+      auto result = dictionary.erase(std::next(dictionary.begin(), i), last);
+      model.erase(model.begin() + i, model.begin() + j);
+      if (result != last || !dictionary.valid() || !verify_size(dictionary) ||
+          !std::ranges::equal(dictionary, model)) {
+        ok = false;
+        std::printf("  erase [%d, %d) failed\n", (int)i, (int)j);
+        break;
+      }
+    }
+  }
+  return ok;
+}
+
+bool test_order_statistics(auto &urbg) {
+  std::printf("Test nth, rank, distance\n");
+  bool ok = true;
+  wb::tree<int> dictionary;
+  std::vector<int> model;
+  for (int value = 0; value != 1000; ++value) {
+    auto k = std::uniform_int_distribution<std::size_t>(0, model.size())(urbg);
+    dictionary.insert(std::next(dictionary.begin(), k), value);
+    model.insert(model.begin() + k, value);
+  }
+  const auto &cdictionary = dictionary;
+  std::size_t index{};
+  for (auto iter = dictionary.begin(); iter != dictionary.end(); ++iter) {
+    if (dictionary.nth(index) != iter || cdictionary.nth(index) != iter ||
+        *iter != model[index] || dictionary.rank(iter) != index) {
+      ok = false;
+      std::printf("  order statistics failed at index %d\n", (int)index);
+    }
+    ++index;
+  }
+  if (dictionary.nth(index) != dictionary.end() ||
+      dictionary.rank(dictionary.end()) != dictionary.size()) {
+    ok = false;
+    std::printf("  order statistics failed at end\n");
+  }
+  for (int round = 0; round != 1000; ++round) {
+    std::uniform_int_distribution<std::size_t> dist(0, model.size());
+    std::size_t i = dist(urbg), j = dist(urbg);
+    if (dictionary.distance(dictionary.nth(i), dictionary.nth(j)) !=
+        (std::ptrdiff_t)j - (std::ptrdiff_t)i) {
+      ok = false;
+      std::printf("  distance(%d, %d) failed\n", (int)i, (int)j);
+    }
+  }
+  return ok;
+}
+
+bool test_indexed_iterator(auto &urbg) {
+  std::printf("Test indexed_iterator\n");
+  bool ok = true;
+  std::vector<int> model(1000);
+  std::iota(model.begin(), model.end(), 0);
+  wb::tree<int> dictionary(model.begin(), model.end());
+  auto range = dictionary.indexed();
+  if (std::ranges::distance(range) != (std::ptrdiff_t)model.size()) {
+    ok = false;
+    std::printf("  ranges::distance failed\n");
+  }
+  std::uniform_int_distribution<std::ptrdiff_t> dist(0, model.size());
+  for (int round = 0; round != 1000; ++round) {
+    std::ptrdiff_t i = dist(urbg), j = dist(urbg);
+    auto iter = range.begin() + i;
+    auto jter = iter;
+    std::ranges::advance(jter, j - i);
+    if (iter.base() != dictionary.nth(i) || jter.base() != dictionary.nth(j) ||
+        jter - iter != j - i || (iter < jter) != (i < j) ||
+        (i != (std::ptrdiff_t)model.size() && iter[0] != model[i]) ||
+        (j != (std::ptrdiff_t)model.size() && range.begin()[j] != model[j])) {
+      ok = false;
+      std::printf("  advance from %d to %d failed\n", (int)i, (int)j);
+    }
+  }
+  // Random access algorithms work on the indexed range
+  std::ranges::shuffle(range, urbg);
+  std::ranges::sort(range);
+  if (!std::ranges::equal(dictionary, model)) {
+    ok = false;
+    std::printf("  sort failed\n");
+  }
+  const auto &cdictionary = dictionary;
+  auto crange = cdictionary.indexed();
+  auto lb = std::ranges::lower_bound(crange, 500);
+  if (lb - crange.begin() != 500 || lb != range.begin() + 500) {
+    ok = false;
+    std::printf("  lower_bound failed\n");
+  }
+  return ok;
+}
+
+bool test_finger_search(auto &urbg) {
+  std::printf("Test finger search\n");
+  bool ok = true;
+  // Values 0 to 99, each repeated three times
+  std::vector<int> model(300);
+  for (std::size_t i = 0; i != model.size(); ++i) { model[i] = (int)i / 3; }
+  wb::tree<int> dictionary(model.begin(), model.end());
+  std::uniform_int_distribution<int> value_dist(-1, 100);
+  std::uniform_int_distribution<std::size_t> index_dist(0, model.size());
+  for (int round = 0; round != 2000; ++round) {
+    int a = value_dist(urbg), b = value_dist(urbg);
+    if (a > b) { std::swap(a, b); }
+    auto hint = dictionary.nth(index_dist(urbg));
+    auto [l, r] = dictionary.range_between(make_cmp(a), make_cmp(b));
+    auto [el, er] = dictionary.equal_range(make_cmp(a));
+    if (dictionary.lower_bound(hint, make_cmp(a)) != l ||
+        dictionary.upper_bound(hint, make_cmp(b)) != r ||
+        dictionary.range_between(hint, make_cmp(a), make_cmp(b)) !=
+          std::make_tuple(l, r) ||
+        dictionary.equal_range(hint, make_cmp(a)) != std::make_tuple(el, er)) {
+      ok = false;
+      std::printf("  finger search for [%d, %d] from %d failed\n", a, b,
+        (int)dictionary.rank(hint));
+    }
+  }
+  wb::tree<int> empty;
+  if (empty.lower_bound(empty.end(), make_cmp(0)) != empty.end()) {
+    ok = false;
+    std::printf("  finger search in empty tree failed\n");
+  }
+  return ok;
+}
+
+// The branch-free and the branching descents find the same bounds
+bool test_descents(auto &urbg) {
+  std::printf("Test branch-free descent\n");
+  bool ok = true;
+  for (int round = 0; ok && round != 100; ++round) {
+    std::vector<float> model(std::uniform_int_distribution<int>(1, 300)(urbg));
+    for (auto &x: model) {
+      x = (float)std::uniform_int_distribution<int>(0, 50)(urbg);
+    }
+    std::ranges::sort(model);
+    wb::tree<float> dictionary(model.begin(), model.end());
+    for (float a = -1.0f; a <= 51.0f; a += 0.5f) {
+      auto lower = std::ranges::lower_bound(model, a) - model.begin();
+      auto upper = std::ranges::upper_bound(model, a) - model.begin();
+      if (dictionary.rank(dictionary.lower_bound(cmp<float>{a})) !=
+            (std::size_t)lower ||
+          dictionary.rank(dictionary.upper_bound(cmp<float>{a})) !=
+            (std::size_t)upper ||
+          dictionary.rank(dictionary.lower_bound(int_cmp<float>{a})) !=
+            (std::size_t)lower ||
+          dictionary.rank(dictionary.upper_bound(int_cmp<float>{a})) !=
+            (std::size_t)upper) {
+        ok = false;
+        std::printf("  bounds of %g failed\n", (double)a);
+        break;
+      }
+    }
+  }
+  return ok;
+}
+
+bool test_batched_search(auto &urbg) {
+  std::printf("Test lower_bounds, equal_ranges\n");
+  bool ok = true;
+  for (int round = 0; round != 100; ++round) {
+    // Values 0 to n - 1, each repeated twice
+    int n = std::uniform_int_distribution<int>(0, 200)(urbg);
+    std::vector<int> model(2 * n);
+    for (int i = 0; i != 2 * n; ++i) { model[i] = i / 2; }
+    wb::tree<int> dictionary(model.begin(), model.end());
+    std::vector<cmp<int>> queries(std::uniform_int_distribution<int>(0, 50)(urbg));
+    std::uniform_int_distribution<int> value_dist(-1, n);
+    for (auto &query: queries) { query = make_cmp(value_dist(urbg)); }
+    std::ranges::sort(queries, {}, &cmp<int>::a);
+    std::vector<wb::tree<int>::iterator> bounds;
+    std::vector<std::tuple<wb::tree<int>::iterator, wb::tree<int>::iterator>> ranges;
+    dictionary.lower_bounds(queries.begin(), queries.end(), std::back_inserter(bounds));
+    dictionary.equal_ranges(queries.begin(), queries.end(), std::back_inserter(ranges));
+    if (bounds.size() != queries.size() || ranges.size() != queries.size()) {
+      ok = false;
+      std::printf("  wrong number of results\n");
+      continue;
+    }
+    for (std::size_t i = 0; i != queries.size(); ++i) {
+      if (bounds[i] != dictionary.lower_bound(queries[i]) ||
+          ranges[i] != dictionary.equal_range(queries[i])) {
+        ok = false;
+        std::printf("  batched search for %d failed\n", queries[i].a);
+      }
+    }
+  }
+  return ok;
+}
+
+bool test_stats() {
+  std::printf("Test stats\n");
+  bool ok = true;
+  wb::tree<int, std::allocator<int>, wb::stats_tree_traits> dictionary;
+  for (int value = 0; value != 1000; ++value) {
+    dictionary.insert(dictionary.end(), value);
+  }
+  auto stats = dictionary.stats();
+  std::size_t nodes{};
+  for (auto count: stats.depth_histogram) { nodes += count; }
+  if (stats.allocations != 1000 || stats.rebalances != 1000 ||
+      !stats.single_rotations || stats.searches || nodes != 1000 ||
+      stats.height < 10 || stats.height > 20) {
+    ok = false;
+    std::printf("  insertion statistics are wrong\n");
+  }
+  dictionary.reset_stats();
+  auto iter = dictionary.lower_bound(make_cmp(500));
+  dictionary.erase(iter);
+  stats = dictionary.stats();
+  if (stats.searches != 1 || stats.comparisons < 10 ||
+      stats.comparisons > stats.height || stats.deallocations != 1 ||
+      stats.rebalances != 1 || stats.allocations) {
+    ok = false;
+    std::printf("  search statistics are wrong\n");
+  }
+  return ok;
+}
+
+template <typename Delta, typename Gamma> struct balance_traits: wb::tree_traits {
+  static constexpr bool collect_stats = true;
+  using balance = wb::balance_policy<Delta, Gamma>;
+};
+
+// Insert, erase, split and join at random under the balance parameters,
+// returning the rotations made while appending 1000 values in order
+template <typename Delta, typename Gamma>
+std::size_t check_balance_policy(auto &urbg, bool &ok) {
+  using policy_tree =
+    wb::tree<int, std::allocator<int>, balance_traits<Delta, Gamma>>;
+  policy_tree dictionary;
+  for (int value = 0; value != 1000; ++value) {
+    dictionary.insert(dictionary.end(), value);
+  }
+  auto stats = dictionary.stats();
+  std::size_t rotations = stats.single_rotations + stats.double_rotations;
+  std::vector<int> model(dictionary.begin(), dictionary.end());
+  for (int round = 0; ok && round != 2000; ++round) {
+    int value = std::uniform_int_distribution<int>(0, 1999)(urbg);
+    if (round % 3) {
+      dictionary.insert(dictionary.lower_bound(make_cmp(value)), value);
+      model.insert(std::ranges::lower_bound(model, value), value);
+    } else if (auto i = dictionary.lower_bound(make_cmp(value));
+               i != dictionary.end()) {
+      model.erase(model.begin() + (std::ptrdiff_t)dictionary.rank(i));
+      dictionary.erase(i);
+    }
+    if (round % 100 == 99) {
+      auto tail = dictionary.split(dictionary.lower_bound(make_cmp(value)));
+      dictionary.splice(dictionary.end(), std::move(tail));
+    }
+    if (!dictionary.valid() || !std::ranges::equal(dictionary, model)) {
+      ok = false;
+      std::printf("  round %d failed for delta %d/%d, gamma %d/%d\n", round,
+        (int)Delta::num, (int)Delta::den, (int)Gamma::num, (int)Gamma::den);
+    }
+  }
+  return rotations;
+}
+
+bool test_balance_policy(auto &urbg) {
+  std::printf("Test balance_policy\n");
+  bool ok = true;
+  using std::ratio;
+  static_assert(std::is_same_v<wb::tree_traits::balance,
+    wb::balance_policy<ratio<3>, ratio<2>>>);
+  std::size_t tight = check_balance_policy<ratio<5, 2>, ratio<3, 2>>(urbg, ok);
+  check_balance_policy<ratio<3>, ratio<2>>(urbg, ok);
+  check_balance_policy<ratio<13, 4>, ratio<7, 4>>(urbg, ok);
+  std::size_t loose = check_balance_policy<ratio<4>, ratio<3, 2>>(urbg, ok);
+  if (ok && loose >= tight) {
+    ok = false;
+    std::printf("  a looser balance rotated no less\n");
+  }
+  return ok;
+}
+
+bool test_deferred_balance(auto &urbg) {
+  std::printf("Test deferred_balance\n");
+  bool ok = true;
+  using stats_tree = wb::tree<int, std::allocator<int>, wb::stats_tree_traits>;
+  std::vector<int> model(1000);
+  for (int i = 0; i != 1000; ++i) { model[i] = 100 * i; }
+  stats_tree dictionary(model.begin(), model.end());
+  {
+    // A burst of neighbouring insertions, then scattered ones, keeps the
+    // height logarithmic
+    stats_tree::deferred_balance guard(dictionary);
+    auto position = dictionary.lower_bound(make_cmp(50000));
+    for (int value = 49999; value != 49999 - 90; --value) {
+      position = dictionary.insert(position, value);
+      model.insert(std::ranges::lower_bound(model, value), value);
+    }
+    for (int round = 0; round != 5000; ++round) {
+      int value = std::uniform_int_distribution<int>(0, 99999)(urbg);
+      dictionary.insert(dictionary.lower_bound(make_cmp(value)), value);
+      model.insert(std::ranges::lower_bound(model, value), value);
+    }
+    auto stats = dictionary.stats();
+    if (stats.height > 3 * 13 || dictionary.size() != model.size() ||
+        !std::ranges::equal(dictionary, model)) {
+      ok = false;
+      std::printf("  deferred insertion failed\n");
+    }
+  }
+  if (!dictionary.valid() || !std::ranges::equal(dictionary, model)) {
+    ok = false;
+    std::printf("  rebalancing after a burst failed\n");
+  }
+  {
+    // Other modifications rebalance first
+    stats_tree::deferred_balance guard(dictionary);
+    for (int value = 0; value != 100; ++value) {
+      dictionary.insert(dictionary.end(), 100000 + value);
+      model.push_back(100000 + value);
+    }
+    dictionary.erase(dictionary.begin());
+    model.erase(model.begin());
+    if (!dictionary.valid()) {
+      ok = false;
+      std::printf("  erase did not rebalance\n");
+    }
+    auto tail = dictionary.split(dictionary.nth(model.size() / 2));
+    dictionary.splice(dictionary.end(), std::move(tail));
+    for (int value = 0; value != 100; ++value) {
+      dictionary.insert(dictionary.begin(), -value);
+      model.insert(model.begin(), -value);
+    }
+    dictionary.exchange_elements(dictionary.begin(), std::prev(dictionary.end()));
+    std::swap(model.front(), model.back());
+  }
+  if (!dictionary.valid() || !std::ranges::equal(dictionary, model)) {
+    ok = false;
+    std::printf("  modification under deferred_balance failed\n");
+  }
+  {
+    // Rebalancing at the end of a burst counts into the bursting tree,
+    // even after another tree has made and freed its own counters
+    stats_tree::deferred_balance guard(dictionary);
+    for (int round = 0; round != 500; ++round) {
+      int value = std::uniform_int_distribution<int>(0, 99999)(urbg);
+      dictionary.insert(dictionary.lower_bound(make_cmp(value)), value);
+      model.insert(std::ranges::lower_bound(model, value), value);
+    }
+    dictionary.reset_stats();
+    auto other = std::make_unique<stats_tree>();
+    for (int value = 0; value != 100; ++value) {
+      other->insert(other->end(), value);
+    }
+    other.reset();
+  }
+  auto stats = dictionary.stats();
+  if (stats.single_rotations + stats.double_rotations == 0 ||
+      !dictionary.valid() || !std::ranges::equal(dictionary, model)) {
+    ok = false;
+    std::printf("  interleaved statistics failed\n");
+  }
+  return ok;
+}
+
+bool test_frozen_tree(auto &urbg) {
+  std::printf("Test frozen_tree\n");
+  bool ok = true;
+  for (int n: {0, 1, 2, 3, 7, 8, 100, 1000}) {
+    std::vector<int> model(n);
+    for (int i = 0; i != n; ++i) { model[i] = 2 * (i / 3); }
+    wb::tree<int> dictionary(model.begin(), model.end());
+    auto frozen = wb::freeze(dictionary);
+    if (frozen.size() != model.size() || !std::ranges::equal(frozen, model) ||
+        !std::ranges::equal(std::views::reverse(frozen),
+          std::views::reverse(model))) {
+      ok = false;
+      std::printf("  frozen copy of size %d is wrong\n", n);
+    }
+    for (int round = 0; round != 100; ++round) {
+      int a = std::uniform_int_distribution<int>(-1, n)(urbg);
+      int b = std::uniform_int_distribution<int>(a, n + 1)(urbg);
+      auto [first, last] = frozen.range_between(make_cmp(a), make_cmp(b));
+      auto [dfirst, dlast] = dictionary.range_between(make_cmp(a), make_cmp(b));
+      auto [efirst, elast] = frozen.equal_range(make_cmp(a));
+      auto [edfirst, edlast] = dictionary.equal_range(make_cmp(a));
+      if (!std::ranges::equal(std::ranges::subrange(first, last),
+            std::ranges::subrange(dfirst, dlast)) ||
+          !std::ranges::equal(std::ranges::subrange(efirst, elast),
+            std::ranges::subrange(edfirst, edlast)) ||
+          (first == frozen.end()) != (dfirst == dictionary.end()) ||
+          (elast == frozen.end()) != (edlast == dictionary.end())) {
+        ok = false;
+        std::printf("  search of frozen copy of size %d failed\n", n);
+        break;
+      }
+    }
+  }
+  // A tree whose pool allocator serves single nodes freezes into an array
+  // from the standard allocator, and a plain (forward) range freezes too
+  std::vector<int> model(1000);
+  std::iota(model.begin(), model.end(), 0);
+  wb::tree<int, wb::pool_allocator<int, 8>> pooled(model.begin(), model.end());
+  wb::frozen_tree<int> frozen = wb::freeze(pooled);
+  std::forward_list<int> list(model.begin(), model.end());
+  wb::frozen_tree<int> listed(list.begin(), list.end());
+  if (!std::ranges::equal(frozen, model) ||
+      !std::ranges::equal(listed, model)) {
+    ok = false;
+    std::printf("  freezing a pool tree or a forward list failed\n");
+  }
+  // Freezing under a deferred_balance guard sees the pending insertions
+  {
+    wb::tree<int> dictionary(model.begin(), model.begin() + 100);
+    wb::tree<int>::deferred_balance guard(dictionary);
+    for (int value = 100; value != 120; ++value) {
+      dictionary.insert(dictionary.end(), value);
+    }
+    auto pending = wb::freeze(dictionary);
+    if (pending.size() != 120 ||
+        !std::ranges::equal(pending, std::views::iota(0, 120))) {
+      ok = false;
+      std::printf("  freezing under deferred_balance failed\n");
+    }
+  }
+  // Values need not be default-constructible, and copies are deep
+  struct boxed {
+    int value;
+    explicit boxed(int value): value(value) {}
+  };
+  std::vector<boxed> boxes;
+  for (int value: model) { boxes.emplace_back(value); }
+  wb::frozen_tree<boxed> boxed_tree(boxes.begin(), boxes.end());
+  wb::frozen_tree<boxed> copy = boxed_tree;
+  boxed_tree = wb::frozen_tree<boxed>();
+  auto first = copy.lower_bound(
+    [](const boxed &x) { return x.value < 500 ? -1 : x.value > 500; });
+  if (!boxed_tree.empty() || first == copy.end() || first->value != 500 ||
+      !std::ranges::equal(copy, model, {}, &boxed::value)) {
+    ok = false;
+    std::printf("  freezing values without a default constructor failed\n");
+  }
+  return ok;
+}
+
+template <typename Tree> bool test_block_tree(auto &urbg) {
+  bool ok = true;
+  std::vector<int> model(100);
+  for (int i = 0; i != 100; ++i) { model[i] = 2 * i; }
+  Tree dictionary(model.begin(), model.end());
+  for (int round = 0; round != 5000; ++round) {
+    int value = std::uniform_int_distribution<int>(-10, 1010)(urbg);
+    if (model.empty() || round % 5 < 3) {
+      // Neighbouring insertions at the lower bound or, sometimes, at the
+      // upper bound
+      auto iter = round % 2 ? dictionary.lower_bound(make_cmp(value))
+                            : dictionary.upper_bound(make_cmp(value));
+      auto model_iter = round % 2 ? std::ranges::lower_bound(model, value)
+                                  : std::ranges::upper_bound(model, value);
+      iter = dictionary.insert(iter, value);
+      model.insert(model_iter, value);
+      if (*iter != value) { ok = false; }
+    } else {
+      auto iter = dictionary.lower_bound(make_cmp(value));
+      auto model_iter = std::ranges::lower_bound(model, value);
+      if (iter == dictionary.end()) { continue; }
+      iter = dictionary.erase(iter);
+      model_iter = model.erase(model_iter);
+      if ((iter == dictionary.end()) != (model_iter == model.end()) ||
+          (iter != dictionary.end() && *iter != *model_iter)) {
+        ok = false;
+      }
+    }
+  }
+  if (!dictionary.valid() || dictionary.size() != model.size() ||
+      !std::ranges::equal(dictionary, model) ||
+      !std::ranges::equal(std::views::reverse(dictionary),
+        std::views::reverse(model))) {
+    ok = false;
+    std::printf("  modification failed\n");
+  }
+  for (int a = -5; a < 1020; a += 7) {
+    auto [first, last] = dictionary.range_between(make_cmp(a), make_cmp(a + 3));
+    auto model_first = std::ranges::lower_bound(model, a);
+    auto model_last = std::ranges::upper_bound(model, a + 3);
+    if (!std::ranges::equal(std::ranges::subrange(first, last),
+          std::ranges::subrange(model_first, model_last))) {
+      ok = false;
+      std::printf("  range_between failed\n");
+      break;
+    }
+  }
+  // Exchanged elements take their iterators with them
+  auto i = dictionary.begin(), j = std::prev(dictionary.end());
+  int a = *i, b = *j;
+  dictionary.exchange_elements(i, j);
+  if (*i != a || *j != b || j != dictionary.begin() ||
+      std::next(i) != dictionary.end() || !dictionary.valid()) {
+    ok = false;
+    std::printf("  exchange_elements failed\n");
+  }
+  dictionary.exchange_elements(i, j);
+  // Iterators to the other elements survive insertions and erasures,
+  // which move values between and within blocks
+  std::vector<std::tuple<typename Tree::iterator, int>> kept;
+  for (auto iter = dictionary.begin(); iter != dictionary.end(); ++iter) {
+    if (kept.size() < 50 &&
+        std::uniform_int_distribution<int>(0, 9)(urbg) == 0) {
+      kept.emplace_back(iter, *iter);
+    }
+  }
+  for (int round = 0; round != 2000; ++round) {
+    int value = std::uniform_int_distribution<int>(-10, 1010)(urbg);
+    auto iter = dictionary.lower_bound(make_cmp(value));
+    if (round % 3) {
+      dictionary.insert(iter, value);
+    } else if (iter != dictionary.end() &&
+               std::ranges::none_of(kept, [&iter](const auto &entry) {
+                 return std::get<0>(entry) == iter;
+               })) {
+      dictionary.erase(iter);
+    }
+  }
+  if (!dictionary.valid() ||
+      !std::ranges::all_of(kept, [](const auto &entry) {
+        return *std::get<0>(entry) == std::get<1>(entry);
+      })) {
+    ok = false;
+    std::printf("  iterators did not survive modification\n");
+  }
+  return ok;
+}
+
+bool test_node_handles(auto &urbg) {
+  std::printf("Test emplace, extract, relocate\n");
+  bool ok = true;
+  using stats_tree = wb::tree<int, std::allocator<int>, wb::stats_tree_traits>;
+  std::vector<int> model(1000);
+  std::iota(model.begin(), model.end(), 0);
+  stats_tree dictionary(model.begin(), model.end());
+  dictionary.reset_stats();
+  for (int round = 0; round != 2000; ++round) {
+    std::size_t i = std::uniform_int_distribution<std::size_t>(0, 999)(urbg);
+    std::size_t j = std::uniform_int_distribution<std::size_t>(0, 999)(urbg);
+    auto from = dictionary.nth(i);
+    const int *address = &*from;
+    if (round % 2) {
+      auto handle = dictionary.extract(from);
+      if (handle.empty() || handle.value() != model[i]) { ok = false; }
+      int value = model[i];
+      model.erase(model.begin() + i);
+      auto iter = dictionary.insert(dictionary.nth(j), std::move(handle));
+      model.insert(model.begin() + j, value);
+      if (!handle.empty() || &*iter != address) { ok = false; }
+    } else {
+      // Afterwards 'from' points to the element in its new position
+      dictionary.relocate(from, dictionary.nth(j));
+      int value = model[i];
+      std::size_t k = j > i ? j - 1 : j;
+      model.erase(model.begin() + i);
+      model.insert(model.begin() + k, value);
+      if (dictionary.rank(from) != k || &*from != address) { ok = false; }
+    }
+  }
+  {
+    // A handle that is not reinserted frees its node
+    auto handle = dictionary.extract(dictionary.begin());
+    model.erase(model.begin());
+  }
+  auto stats = dictionary.stats();
+  if (!ok || stats.allocations || !dictionary.valid() ||
+      !std::ranges::equal(dictionary, model)) {
+    ok = false;
+    std::printf("  extract, insert and relocate failed\n");
+  }
+  wb::tree<std::pair<int, int>> pairs;
+  auto iter = pairs.emplace(pairs.end(), 1, 2);
+  pairs.emplace(iter, 0, 1);
+  if (pairs.size() != 2 || pairs.begin()->second != 1 || iter->first != 1) {
+    ok = false;
+    std::printf("  emplace failed\n");
+  }
+  return ok;
+}
+
+bool test_aggregate(auto &urbg) {
+  std::printf("Test aggregate\n");
+  using augmented_tree = wb::tree<int, std::allocator<int>, augmented_traits>;
+  std::vector<int> model;
+  for (int i = 0; i != 500; ++i) { model.push_back(i * 7 % 1000); }
+  augmented_tree dictionary(model.begin(), model.end());
+  auto index = [&](std::size_t n) {
+    return std::uniform_int_distribution<std::size_t>(0, n)(urbg);
+  };
+  auto check = [&]() {
+    if (!dictionary.valid() || !std::ranges::equal(dictionary, model)) {
+      return false;
+    }
+    for (int k = 0; k != 10; ++k) {
+      std::size_t i = index(model.size()), j = index(model.size());
+      if (i > j) { std::swap(i, j); }
+      range_summary expected = range_augmentation::identity();
+      for (std::size_t m = i; m != j; ++m) {
+        expected = range_augmentation::combine(
+          expected, range_augmentation::lift(model[m]));
+      }
+      if (dictionary.aggregate(dictionary.nth(i), dictionary.nth(j)) !=
+          expected) {
+        return false;
+      }
+    }
+    return true;
+  };
+  bool ok = check();
+  for (int round = 0; ok && round != 1000; ++round) {
+    std::size_t n = model.size();
+    switch (round % 7) {
+    case 0: {
+      std::size_t i = index(n);
+      int value = (int)index(1000);
+      dictionary.insert(dictionary.nth(i), value);
+      model.insert(model.begin() + i, value);
+      break;
+    }
+    case 1: {
+      std::size_t i = index(n - 1);
+      dictionary.erase(dictionary.nth(i));
+      model.erase(model.begin() + i);
+      break;
+    }
+    case 2: {
+      std::size_t i = index(n - 1), j = index(n - 1);
+      dictionary.exchange_elements(dictionary.nth(i), dictionary.nth(j));
+      std::swap(model[i], model[j]);
+      break;
+    }
+    case 3: {
+      std::size_t i = index(n - 1), j = index(n);
+      dictionary.relocate(dictionary.nth(i), dictionary.nth(j));
+      int value = model[i];
+      model.erase(model.begin() + i);
+      model.insert(model.begin() + (j > i ? j - 1 : j), value);
+      break;
+    }
+    case 4: {
+      // Modify an element in place
+      std::size_t i = index(n - 1);
+      auto iter = dictionary.nth(i);
+      *iter = model[i] = (int)index(1000);
+      dictionary.refresh(iter);
+      break;
+    }
+    case 5: {
+      std::size_t i = index(n), j = index(n);
+      augmented_tree right = dictionary.split(dictionary.nth(i));
+      dictionary.splice(dictionary.end(), std::move(right));
+      if (i > j) { std::swap(i, j); }
+      if (j - i < 20) {
+        dictionary.erase(dictionary.nth(i), dictionary.nth(j));
+        model.erase(model.begin() + i, model.begin() + j);
+      }
+      break;
+    }
+    case 6: {
+      augmented_tree::deferred_balance guard(dictionary);
+      for (int k = 0; k != 20; ++k) {
+        std::size_t i = index(model.size());
+        int value = (int)index(1000);
+        dictionary.insert(dictionary.nth(i), value);
+        model.insert(model.begin() + i, value);
+      }
+      break;
+    }
+    }
+    ok = check();
+  }
+  range_summary whole = dictionary.aggregate();
+  if (!ok ||
+      whole != dictionary.aggregate(dictionary.begin(), dictionary.end()) ||
+      whole.sum != std::accumulate(model.begin(), model.end(), 0ll)) {
+    ok = false;
+    std::printf("  aggregate failed\n");
+  }
+  return ok;
+}
+
+bool test_for_each(auto &urbg) {
+  std::printf("Test for_each, copy_to\n");
+  bool ok = true;
+  wb::tree<int> dictionary;
+  std::vector<int> model;
+  // Insert at random positions, so that the shape is irregular
+  for (int i = 0; i != 3000; ++i) {
+    std::size_t j =
+      std::uniform_int_distribution<std::size_t>(0, model.size())(urbg);
+    dictionary.insert(dictionary.nth(j), i);
+    model.insert(model.begin() + j, i);
+  }
+  const auto &cdictionary = dictionary;
+  std::vector<int> visited;
+  cdictionary.for_each([&](const int &x) { visited.push_back(x); });
+  if (visited != model) {
+    ok = false;
+    std::printf("  for_each failed\n");
+  }
+  for (int round = 0; round != 200; ++round) {
+    std::size_t i =
+      std::uniform_int_distribution<std::size_t>(0, model.size())(urbg);
+    std::size_t j =
+      std::uniform_int_distribution<std::size_t>(i, model.size())(urbg);
+    visited.clear();
+    cdictionary.for_each(cdictionary.nth(i), cdictionary.nth(j),
+      [&](const int &x) { visited.push_back(x); });
+    if (!std::equal(visited.begin(), visited.end(), model.begin() + i,
+          model.begin() + j)) {
+      ok = false;
+      std::printf("  for_each(first, last) failed for [%d, %d)\n", (int)i,
+        (int)j);
+      break;
+    }
+  }
+  // Modify the elements through the mutable overloads
+  dictionary.for_each([](int &x) { x *= 2; });
+  dictionary.for_each(
+    dictionary.nth(100), dictionary.nth(200), [](int &x) { ++x; });
+  for (std::size_t i = 0; i != model.size(); ++i) {
+    model[i] = model[i] * 2 + (i >= 100 && i < 200);
+  }
+  std::vector<int> copy(model.size() + 1, -1);
+  auto end = dictionary.copy_to(copy.begin());
+  if (end != copy.begin() + model.size() || copy.back() != -1 ||
+      !std::equal(model.begin(), model.end(), copy.begin())) {
+    ok = false;
+    std::printf("  copy_to failed\n");
+  }
+  // An empty tree and an empty range visit nothing
+  wb::tree<int> empty;
+  int count = 0;
+  empty.for_each([&](int) { ++count; });
+  dictionary.for_each(
+    dictionary.end(), dictionary.end(), [&](int) { ++count; });
+  if (count || empty.copy_to(copy.begin()) != copy.begin()) {
+    ok = false;
+    std::printf("  empty for_each failed\n");
+  }
+  return ok;
+}
+
+bool test_image(auto &urbg) {
+  std::printf("Test serialize, load, image_view\n");
+  bool ok = true;
+  auto fail = [&ok](const char *what) {
+    ok = false;
+    std::printf("  %s failed\n", what);
+  };
+  // Copy a serialized tree to suitably aligned storage, as 'mmap' would
+  // provide
+  auto image_of = [](const auto &dictionary) {
+    std::ostringstream out;
+    wb::serialize(dictionary, out);
+    std::string bytes = out.str();
+    std::vector<std::max_align_t> storage(
+      (bytes.size() + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+    return std::make_pair(std::move(storage), bytes.size());
+  };
+  auto span_of = [](const auto &image) {
+    return std::span(
+      reinterpret_cast<const std::byte *>(image.first.data()), image.second);
+  };
+  for (int n: {0, 1, 2, 100, 5000}) {
+    std::vector<float> model(n);
+    for (auto &x: model) {
+      x = (float)std::uniform_int_distribution<int>(0, 100)(urbg);
+    }
+    std::ranges::sort(model);
+    wb::tree<float> dictionary(model.begin(), model.end());
+    auto image = image_of(dictionary);
+    wb::tree<float> loaded;
+    loaded.insert(loaded.end(), -1.0f);
+    wb::load(loaded, span_of(image));
+    if (!loaded.valid() || !std::ranges::equal(loaded, model)) {
+      fail("load");
+    }
+    wb::image_view<float> view(span_of(image));
+    if (view.size() != model.size() || !std::ranges::equal(view, model)) {
+      fail("image_view");
+    }
+    for (float a = -1.0f; a <= 101.0f; a += 0.5f) {
+      auto [first, last] =
+        view.range_between(cmp<float>{a}, cmp<float>{a + 2});
+      auto [i, j] =
+        dictionary.range_between(cmp<float>{a}, cmp<float>{a + 2});
+      if (first - view.begin() != (std::ptrdiff_t)dictionary.rank(i) ||
+          last - view.begin() != (std::ptrdiff_t)dictionary.rank(j) ||
+          view.lower_bound(cmp<float>{a}) != first ||
+          std::get<1>(view.equal_range(cmp<float>{a + 2})) != last) {
+        fail("image_view search");
+        break;
+      }
+    }
+  }
+  // A type with padding and stricter alignment round-trips too
+  struct alignas(16) record {
+    char key;
+    double value;
+  };
+  std::vector<record> records;
+  for (int i = 0; i != 100; ++i) { records.push_back({(char)i, i * 0.5}); }
+  wb::tree<record> record_tree(records.begin(), records.end());
+  auto record_image = image_of(record_tree);
+  wb::image_view<record> record_view(span_of(record_image));
+  if (record_view.size() != 100 || record_view.begin()[99].value != 49.5 ||
+      reinterpret_cast<std::uintptr_t>(record_view.begin()) % 16) {
+    fail("aligned image");
+  }
+  // Images of another type, truncated or corrupted images are rejected
+  auto rejects = [&](std::span<const std::byte> bytes) {
+    try {
+      wb::image_view<float> view(bytes);
+    } catch (const std::invalid_argument &) { return true; }
+    return false;
+  };
+  std::vector<float> values{1.0f, 2.0f, 3.0f};
+  auto bytes = span_of(record_image);
+  auto image = image_of(wb::tree<float>(values.begin(), values.end()));
+  auto floats = span_of(image);
+  auto corrupted = image;
+  reinterpret_cast<char *>(corrupted.first.data())[0] ^= 1;
+  if (!rejects(bytes) || !rejects(floats.first(floats.size() - 1)) ||
+      !rejects(floats.first(16)) || !rejects(span_of(corrupted))) {
+    fail("image validation");
+  }
+  wb::tree<float> unchanged(values.begin(), values.end());
+  try {
+    wb::load(unchanged, span_of(corrupted));
+    fail("load validation");
+  } catch (const std::invalid_argument &) {}
+  if (unchanged.size() != 3) { fail("load validation"); }
+  return ok;
+}
+
+bool test_intrusive_tree(auto &urbg) {
+  std::printf("Test intrusive_tree\n");
+  bool ok = true;
+  auto fail = [&ok](const char *what) {
+    ok = false;
+    std::printf("  %s failed\n", what);
+  };
+  struct by_x;
+  struct by_y;
+  struct segment: wb::intrusive_hook<by_x>, wb::intrusive_hook<by_y> {
+    int x;
+    int y;
+  };
+  auto key = [](int segment::*member, int a) {
+    return [member, a](const segment &s) { return s.*member <=> a; };
+  };
+  // The objects live in an arena and are linked into two trees at once
+  std::vector<segment> arena(2000);
+  wb::intrusive_tree<segment, by_x> xs;
+  wb::intrusive_tree<segment, by_y> ys;
+  for (auto &s: arena) {
+    s.x = std::uniform_int_distribution<int>(0, 999)(urbg);
+    s.y = std::uniform_int_distribution<int>(0, 999)(urbg);
+    xs.insert(xs.upper_bound(key(&segment::x, s.x)), s);
+    ys.insert(ys.upper_bound(key(&segment::y, s.y)), s);
+  }
+  auto sorted_by = [](auto &tree, int segment::*member) {
+    return std::ranges::is_sorted(tree, {}, member);
+  };
+  if (!xs.valid() || !ys.valid() || xs.size() != arena.size() ||
+      !sorted_by(xs, &segment::x) || !sorted_by(ys, &segment::y)) {
+    fail("insert");
+  }
+  // Erase and reinsert objects found through 'iterator_to'
+  for (int round = 0; round != 2000; ++round) {
+    segment &s = arena[std::uniform_int_distribution<std::size_t>(
+      0, arena.size() - 1)(urbg)];
+    auto i = xs.iterator_to(s);
+    if (&*i != &s || xs.rank(i) != xs.rank(xs.iterator_to(s))) {
+      fail("iterator_to");
+      break;
+    }
+    xs.erase(i);
+    if (static_cast<wb::intrusive_hook<by_x> &>(s).is_linked() ||
+        !static_cast<wb::intrusive_hook<by_y> &>(s).is_linked()) {
+      fail("erase");
+      break;
+    }
+    s.x = std::uniform_int_distribution<int>(0, 999)(urbg);
+    xs.insert(xs.lower_bound(key(&segment::x, s.x)), s);
+  }
+  if (!xs.valid() || xs.size() != arena.size() ||
+      !sorted_by(xs, &segment::x)) {
+    fail("erase and insert");
+  }
+  auto [first, last] =
+    xs.range_between(key(&segment::x, 100), key(&segment::x, 199));
+  std::size_t count = std::ranges::count_if(
+    arena, [](const segment &s) { return s.x >= 100 && s.x <= 199; });
+  if (xs.rank(last) - xs.rank(first) != count ||
+      (first != xs.end() && first->x < 100)) {
+    fail("range_between");
+  }
+  // Exchanging elements moves the objects within one tree only
+  segment *a = &*xs.nth(10), *b = &*xs.nth(20);
+  std::swap(a->x, b->x);
+  xs.exchange_elements(xs.iterator_to(*a), xs.iterator_to(*b));
+  if (!xs.valid() || &*xs.nth(10) != b || !ys.valid() ||
+      !sorted_by(xs, &segment::x)) {
+    fail("exchange_elements");
+  }
+  // A copy is unlinked; moving a tree keeps its elements linked
+  segment copy = arena[0];
+  wb::intrusive_tree<segment, by_x> moved(std::move(xs));
+  if (static_cast<wb::intrusive_hook<by_x> &>(copy).is_linked() ||
+      !xs.empty() || !xs.valid() || moved.size() != arena.size() ||
+      &*moved.iterator_to(arena[0]) != &arena[0] || !moved.valid()) {
+    fail("copy and move");
+  }
+  moved.clear();
+  {
+    wb::intrusive_tree<segment, by_y> scoped(std::move(ys));
+  }
+  for (auto &s: arena) {
+    if (static_cast<wb::intrusive_hook<by_x> &>(s).is_linked() ||
+        static_cast<wb::intrusive_hook<by_y> &>(s).is_linked()) {
+      fail("clear and destroy");
+      break;
+    }
+  }
+  return ok;
+}
+
+bool test_parallel_for_each() {
+  std::printf("Test parallel_for_each\n");
+  bool ok = true;
+  std::vector<int> model(100000);
+  std::iota(model.begin(), model.end(), 0);
+  wb::tree<int> dictionary(model.begin(), model.end());
+  const auto &cdictionary = dictionary;
+  wb::parallel_policy policy{4, 1000};
+  // Each element is visited exactly once
+  wb::parallel_for_each(policy, dictionary, [](int &x) { x *= 2; });
+  std::atomic<long long> sum{};
+  wb::parallel_for_each(policy, cdictionary, [&sum](int x) { sum += x; });
+  if (sum != 99999ll * 100000 || dictionary.size() != model.size()) {
+    ok = false;
+    std::printf("  parallel_for_each over the whole tree failed\n");
+  }
+  // Subranges, under both policies
+  std::atomic<std::size_t> count{};
+  auto counter = [&count](int) { ++count; };
+  wb::parallel_for_each(
+    policy, dictionary, dictionary.nth(123), dictionary.nth(98765), counter);
+  wb::parallel_for_each(
+    wb::seq, cdictionary, cdictionary.nth(5), cdictionary.nth(6), counter);
+  wb::parallel_for_each(
+    wb::par, dictionary, dictionary.end(), dictionary.end(), counter);
+  if (count != 98765 - 123 + 1) {
+    ok = false;
+    std::printf("  parallel_for_each over a subrange failed\n");
+  }
+  // Exceptions propagate to the caller
+  try {
+    wb::parallel_for_each(policy, dictionary, [](int x) {
+      if (x == 2 * 54321) { throw x; }
+    });
+    ok = false;
+    std::printf("  parallel_for_each did not propagate an exception\n");
+  } catch (int x) {
+    if (x != 2 * 54321) { ok = false; }
+  }
+  return ok;
+}
+
+bool test_set_operations(auto &urbg) {
+  std::printf("Test merge, intersection, difference\n");
+  bool ok = true;
+  using tree = wb::tree<int, wb::pool_allocator<int>>;
+  auto three_way = [](int x, int y) { return x <=> y; };
+  for (int round = 0; round != 100; ++round) {
+    // Sorted sequences with duplicates, of sizes differing by up to 100x
+    auto make_model = [&urbg](std::size_t size) {
+      std::vector<int> model(size);
+      for (auto &x: model) { x = std::uniform_int_distribution<int>(0, 999)(urbg); }
+      std::ranges::sort(model);
+      return model;
+    };
+    auto model_a = make_model(std::uniform_int_distribution<std::size_t>(0, 2000)(urbg));
+    auto model_b = make_model(round % 3 ? model_a.size() / 100 : model_a.size());
+    std::vector<int> merged, common, remainder;
+    std::ranges::merge(model_a, model_b, std::back_inserter(merged));
+    for (int x: model_a) {
+      (std::ranges::binary_search(model_b, x) ? common : remainder).push_back(x);
+    }
+    tree::allocator_type alloc;
+    wb::parallel_policy policy{4, 16};
+    auto check = [&](const tree &result, const std::vector<int> &model,
+                   const char *name) {
+      if (!result.valid() || !std::ranges::equal(result, model)) {
+        ok = false;
+        std::printf("  %s of %d and %d failed\n", name, (int)model_a.size(),
+          (int)model_b.size());
+      }
+    };
+    {
+      tree a(model_a.begin(), model_a.end(), alloc);
+      tree b(model_b.begin(), model_b.end(), alloc);
+      check(merge(policy, std::move(a), std::move(b), three_way), merged, "merge");
+      if (!a.empty() || !b.empty()) { ok = false; }
+    }
+    {
+      tree a(model_a.begin(), model_a.end(), alloc);
+      tree b(model_b.begin(), model_b.end(), alloc);
+      check(intersection(round % 2 ? policy : wb::parallel_policy{1},
+              std::move(a), std::move(b), three_way),
+        common, "intersection");
+    }
+    {
+      tree a(model_a.begin(), model_a.end(), alloc);
+      tree b(model_b.begin(), model_b.end(), alloc);
+      check(difference(std::move(a), std::move(b), three_way), remainder,
+        "difference");
+    }
+  }
+  // Merge is stable
+  wb::tree<std::pair<int, int>> a, b;
+  for (int i = 0; i != 100; ++i) {
+    a.insert(a.end(), std::make_pair(i / 10, 0));
+    b.insert(b.end(), std::make_pair(i / 10, 1));
+  }
+  auto c = merge(wb::par, std::move(a), std::move(b),
+    [](auto x, auto y) { return x.first <=> y.first; });
+  if (!std::ranges::is_sorted(c)) {
+    ok = false;
+    std::printf("  merge is not stable\n");
+  }
+  // A comparator that throws part of the way through destroys every node
+  using stats_tree = wb::tree<int, std::allocator<int>, wb::stats_tree_traits>;
+  std::vector<int> evens(500), thirds(300);
+  for (int i = 0; i != 500; ++i) { evens[i] = 2 * i; }
+  for (int i = 0; i != 300; ++i) { thirds[i] = 3 * i; }
+  for (int operation = 0; operation != 3; ++operation) {
+    for (int calls: {0, 1, 5, 50, 500}) {
+      stats_tree a(evens.begin(), evens.end()), b(thirds.begin(), thirds.end());
+      int remaining = calls;
+      auto throwing = [&remaining](int x, int y) {
+        if (!remaining--) { throw std::runtime_error("comparison failed"); }
+        return x <=> y;
+      };
+      try {
+        if (operation == 0) {
+          merge(std::move(a), std::move(b), throwing);
+        } else if (operation == 1) {
+          intersection(std::move(a), std::move(b), throwing);
+        } else {
+          difference(std::move(a), std::move(b), throwing);
+        }
+        ok = false;
+      } catch (const std::runtime_error &) {}
+      if (!a.empty() || !b.empty() ||
+          a.stats().deallocations + b.stats().deallocations != 800) {
+        ok = false;
+        std::printf("  set operation %d throwing after %d calls leaked\n",
+          operation, calls);
+      }
+    }
+  }
+  return ok;
+}
+
+bool test_insert_sorted(auto &urbg) {
+  std::printf("Test insert_sorted\n");
+  bool ok = true;
+  using augmented_tree = wb::tree<int, std::allocator<int>, augmented_traits>;
+  auto three_way = [](int x, int y) { return x <=> y; };
+  std::vector<int> model;
+  augmented_tree dictionary;
+  for (int round = 0; ok && round != 200; ++round) {
+    // Batches from a few values to several times the tree's size
+    std::size_t count =
+      std::uniform_int_distribution<std::size_t>(0, round % 4 ? 50 : 2000)(urbg);
+    std::vector<int> batch(count);
+    for (auto &x: batch) { x = std::uniform_int_distribution<int>(0, 9999)(urbg); }
+    std::ranges::sort(batch);
+    auto kept = dictionary.begin();
+    int value = model.empty() ? 0 : model.front();
+    if (round % 2) {
+      dictionary.insert_sorted(batch.begin(), batch.end(), three_way);
+    } else {
+      dictionary.insert_sorted(
+        wb::parallel_policy{4, 16}, batch.begin(), batch.end(), three_way);
+    }
+    std::vector<int> merged;
+    std::ranges::merge(model, batch, std::back_inserter(merged));
+    model = merged;
+    if (!dictionary.valid() || !std::ranges::equal(dictionary, model) ||
+        (kept != dictionary.end() && *kept != value) ||
+        dictionary.aggregate().sum !=
+          std::accumulate(model.begin(), model.end(), 0ll)) {
+      ok = false;
+      std::printf("  round %d failed\n", round);
+    }
+  }
+  // New values go after equivalent elements, in their order in the batch
+  wb::tree<std::pair<int, int>> pairs;
+  std::vector<std::pair<int, int>> existing, batch;
+  for (int i = 0; i != 100; ++i) {
+    existing.emplace_back(i / 10, 0);
+    batch.emplace_back(i / 20, i + 1);
+  }
+  pairs.assign(existing.begin(), existing.end());
+  pairs.insert_sorted(batch.begin(), batch.end(),
+    [](auto x, auto y) { return x.first <=> y.first; });
+  if (!pairs.valid() || !std::ranges::is_sorted(pairs)) {
+    ok = false;
+    std::printf("  insert_sorted is not stable\n");
+  }
+  // A comparator that throws part of the way through leaves the tree as
+  // it was, and destroys the new nodes
+  using stats_tree = wb::tree<int, std::allocator<int>, stats_augmented_traits>;
+  std::vector<int> evens(500), odds(300);
+  for (int i = 0; i != 500; ++i) { evens[i] = 2 * i; }
+  for (int i = 0; i != 300; ++i) { odds[i] = 2 * i + 1; }
+  for (int calls: {0, 1, 5, 50, 500}) {
+    stats_tree evens_tree(evens.begin(), evens.end());
+    auto kept = evens_tree.nth(321);
+    evens_tree.reset_stats();
+    int remaining = calls;
+    try {
+      evens_tree.insert_sorted(odds.begin(), odds.end(),
+        [&remaining](int x, int y) {
+          if (!remaining--) { throw std::runtime_error("comparison failed"); }
+          return x <=> y;
+        });
+      ok = false;
+    } catch (const std::runtime_error &) {}
+    auto stats = evens_tree.stats();
+    if (!evens_tree.valid() || !std::ranges::equal(evens_tree, evens) ||
+        *kept != 642 || evens_tree.rank(kept) != 321 ||
+        evens_tree.aggregate().sum !=
+          std::accumulate(evens.begin(), evens.end(), 0ll) ||
+        stats.allocations != 300 || stats.deallocations != 300) {
+      ok = false;
+      std::printf("  insert_sorted throwing after %d calls failed\n", calls);
+    }
+  }
+  return ok;
+}
+
+bool test_persistent_tree(auto &urbg) {
+  std::printf("Test persistent_tree\n");
+  bool ok = true;
+  std::vector<int> model(100);
+  std::iota(model.begin(), model.end(), 0);
+  wb::persistent_tree<int> dictionary(model.begin(), model.end());
+  std::vector<std::tuple<wb::persistent_tree<int>, std::vector<int>>> snapshots;
+  for (int round = 0; round != 2000; ++round) {
+    if (round % 100 == 0) { snapshots.emplace_back(dictionary.snapshot(), model); }
+    std::size_t i = std::uniform_int_distribution<std::size_t>(0, model.size())(urbg);
+    if (model.empty() || round % 3) {
+      auto iter = dictionary.insert(dictionary.nth(i), round);
+      model.insert(model.begin() + i, round);
+      if (*iter != round || dictionary.rank(iter) != i) { ok = false; }
+    } else {
+      i %= model.size();
+      dictionary.erase(dictionary.nth(i));
+      model.erase(model.begin() + i);
+    }
+  }
+  if (!dictionary.valid() || !std::ranges::equal(dictionary, model)) {
+    ok = false;
+    std::printf("  modification failed\n");
+  }
+  for (auto &[snapshot, snapshot_model]: snapshots) {
+    if (!snapshot.valid() || !std::ranges::equal(snapshot, snapshot_model) ||
+        !std::ranges::equal(std::views::reverse(snapshot),
+          std::views::reverse(snapshot_model))) {
+      ok = false;
+      std::printf("  snapshot of size %d changed\n", (int)snapshot_model.size());
+    }
+  }
+  // Search a snapshot on another thread while the original is modified
+  std::vector<int> sorted(10000);
+  std::iota(sorted.begin(), sorted.end(), 0);
+  wb::persistent_tree<int> writer(sorted.begin(), sorted.end());
+  std::atomic<bool> reader_ok{true};
+  {
+    std::jthread reader([snapshot = writer.snapshot(), &reader_ok] {
+      for (int value = 0; value != 10000; ++value) {
+        auto iter = snapshot.lower_bound(make_cmp(value));
+        if (iter == snapshot.end() || *iter != value) { reader_ok = false; }
+      }
+    });
+    for (int value = 0; value != 10000; value += 2) {
+      writer.erase(writer.lower_bound(make_cmp(value)));
+    }
+  }
+  if (!reader_ok || writer.size() != 5000 || !writer.valid()) {
+    ok = false;
+    std::printf("  concurrent snapshot search failed\n");
+  }
+  return ok;
+}
+
+// A value whose copies throw with a given probability, while moves succeed
+struct fragile {
+  int value;
+  static inline double failure_rate = 0;
+  static inline std::minstd_rand *urbg;
+
+  fragile(int x): value(x) {}
+  fragile(fragile &&other) noexcept: value(other.value) {}
+  fragile(const fragile &other): value(other.value) {
+    if (std::bernoulli_distribution(failure_rate)(*urbg)) {
+      throw std::runtime_error("copy failed");
+    }
+  }
+};
+
+// Modify persistent trees whose node copies fail at random while they are
+// shared with snapshots, with a different balance policy and with 8-bit
+// sizes, so that the iterators' paths hold few nodes
+bool test_persistent_failures() {
+  std::printf("Test persistent_tree with failing copies\n");
+  bool ok = true;
+  std::minstd_rand urbg(1);
+  fragile::urbg = &urbg;
+  using tree_type = wb::persistent_tree<fragile,
+    wb::pool_allocator<fragile, 64, std::uint8_t>,
+    wb::balance_policy<std::ratio<4>, std::ratio<3, 2>>>;
+  tree_type dictionary;
+  std::vector<int> model;
+  std::size_t failures = 0;
+  for (int round = 0; round != 20000; ++round) {
+    tree_type snapshot = dictionary.snapshot();
+    std::size_t i = std::uniform_int_distribution<std::size_t>(0, model.size())(urbg);
+    bool insert = model.size() < 50 || (model.size() < 250 && round % 3);
+    std::size_t size = dictionary.size();
+    fragile::failure_rate = 0.5;
+    try {
+      if (insert) {
+        dictionary.insert(dictionary.nth(i), fragile(round));
+      } else {
+        dictionary.erase(dictionary.nth(i %= model.size()));
+      }
+    } catch (const std::runtime_error &) {
+      ++failures;
+    }
+    fragile::failure_rate = 0;
+    // The modification is either complete or not made at all
+    if (dictionary.size() != size) {
+      if (insert) {
+        model.insert(model.begin() + i, round);
+      } else {
+        model.erase(model.begin() + i);
+      }
+    }
+    auto value = [](const fragile &x) { return x.value; };
+    if (!std::ranges::equal(dictionary, model, {}, value) ||
+        !std::ranges::equal(std::views::reverse(dictionary),
+          std::views::reverse(model), {}, value)) {
+      ok = false;
+      std::printf("  sequence changed at round %d\n", round);
+      break;
+    }
+  }
+  if (!failures) {
+    ok = false;
+    std::printf("  no copy failed\n");
+  }
+  return ok;
+}
+
+bool test_sweep(auto &urbg) {
+  std::printf("Test sweep_intersections\n");
+  bool ok = true;
+  using point = wb::sweep_event_point;
+  using meeting = std::pair<std::tuple<std::int64_t, std::int64_t, std::int64_t>,
+    std::vector<std::size_t>>;
+  // An event point in lowest terms, with the sorted indices of its segments
+  auto make_meeting = [](const point &p, std::vector<std::size_t> indices) {
+    std::int64_t g = std::gcd(std::gcd(p.x, p.y), p.den);
+    std::ranges::sort(indices);
+    return meeting({p.x / g, p.y / g, p.den / g}, std::move(indices));
+  };
+  for (int round = 0; ok && round != 2000; ++round) {
+    // Segments on small grids meet in every degenerate way
+    int extent = round % 3 == 0 ? 3 : round % 3 == 1 ? 8 : 1000;
+    std::uniform_int_distribution<int> coordinate(-extent, extent);
+    std::vector<wb::sweep_segment> segments(
+      std::uniform_int_distribution<std::size_t>(1, 40)(urbg));
+    for (auto &[a, b]: segments) {
+      a = {coordinate(urbg), coordinate(urbg)};
+      b = {round % 5 ? coordinate(urbg) : a.x, round % 7 ? coordinate(urbg) : a.y};
+    }
+    std::vector<meeting> found;
+    std::size_t events = wb::sweep_intersections(segments,
+      [&](const point &p, std::span<const std::size_t> indices) {
+        found.push_back(make_meeting(p, {indices.begin(), indices.end()}));
+      });
+    std::ranges::sort(found);
+    // Test every endpoint and every crossing of two segments
+    auto contains = [](const wb::sweep_segment &s, const point &p) {
+      std::int64_t dx = s.b.x - s.a.x, dy = s.b.y - s.a.y;
+      auto between = [&p](std::int64_t a, std::int64_t b, std::int64_t x) {
+        return (std::min)(a, b) * p.den <= x && x <= (std::max)(a, b) * p.den;
+      };
+      return dx * (p.y - s.a.y * p.den) == dy * (p.x - s.a.x * p.den) &&
+             between(s.a.x, s.b.x, p.x) && between(s.a.y, s.b.y, p.y);
+    };
+    std::vector<point> candidates;
+    for (auto &[a, b]: segments) {
+      candidates.push_back({a.x, a.y, 1});
+      candidates.push_back({b.x, b.y, 1});
+    }
+    for (auto &s: segments) {
+      for (auto &t: segments) {
+        std::int64_t rx = s.b.x - s.a.x, ry = s.b.y - s.a.y;
+        std::int64_t qx = t.b.x - t.a.x, qy = t.b.y - t.a.y;
+        std::int64_t den = rx * qy - ry * qx;
+        std::int64_t u = (t.a.x - s.a.x) * qy - (t.a.y - s.a.y) * qx;
+        if (den < 0) {
+          den = -den;
+          u = -u;
+        }
+        if (den && u >= 0 && u <= den) {
+          point p{s.a.x * den + rx * u, s.a.y * den + ry * u, den};
+          if (contains(t, p)) { candidates.push_back(p); }
+        }
+      }
+    }
+    std::vector<meeting> expected;
+    for (auto &p: candidates) {
+      std::vector<std::size_t> indices;
+      for (std::size_t i = 0; i != segments.size(); ++i) {
+        if (contains(segments[i], p)) { indices.push_back(i); }
+      }
+      if (indices.size() > 1) { expected.push_back(make_meeting(p, indices)); }
+    }
+    std::ranges::sort(expected);
+    expected.erase(std::ranges::unique(expected).begin(), expected.end());
+    if (found != expected || events < found.size()) {
+      ok = false;
+      std::printf("  round %d found %d meetings rather than %d\n", round,
+        (int)found.size(), (int)expected.size());
+    }
+  }
+  try {
+    std::vector<wb::sweep_segment> far{{{0, 0}, {1 << 19, 0}}};
+    wb::sweep_intersections(far, [](const point &, auto) {});
+    ok = false;
+    std::printf("  coordinates out of range were accepted\n");
+  } catch (const std::invalid_argument &) {
+  }
+  return ok;
+}
+
+bool test_concurrent_tree() {
+  std::printf("Test concurrent_tree\n");
+  // Readers search the current version while a writer inserts the odd
+  // numbers into a tree of the even numbers, in small batches
+  std::vector<int> evens(5000);
+  for (int i = 0; i != 5000; ++i) { evens[i] = 2 * i; }
+  wb::concurrent_tree<int> dictionary(evens.begin(), evens.end());
+  std::atomic<bool> done{false}, readers_ok{true};
+  {
+    std::vector<std::jthread> readers;
+    for (int r = 0; r != 2; ++r) {
+      readers.emplace_back([&dictionary, &done, &readers_ok] {
+        std::size_t last_size = 0;
+        for (int value = 0; !done; value = (value + 14) % 10000) {
+          auto snapshot = dictionary.snapshot();
+          auto [first, last] =
+            snapshot.range_between(make_cmp(value), make_cmp(value));
+          bool found = dictionary.read([value](const auto &version) {
+            auto iter = version.lower_bound(make_cmp(value));
+            return iter != version.end() && *iter == value;
+          });
+          if (snapshot.size() < last_size || first == last || !found ||
+              *first != value) {
+            readers_ok = false;
+          }
+          last_size = snapshot.size();
+        }
+      });
+    }
+    for (int value = 1; value < 10000; value += 20) {
+      dictionary.write([value](auto &working) {
+        for (int odd = value; odd < value + 20; odd += 2) {
+          working.insert(working.lower_bound(make_cmp(odd)), odd);
+        }
+      });
+    }
+    done = true;
+  }
+  auto result = dictionary.snapshot();
+  bool ok = readers_ok && result.valid() && result.size() == 10000 &&
+            std::ranges::equal(result, std::views::iota(0, 10000));
+  if (!ok) { std::printf("  concurrent search failed\n"); }
+  // A write that throws publishes nothing, and the next write starts from
+  // the current version
+  try {
+    dictionary.write([](auto &working) {
+      working.insert(working.end(), 10000);
+      throw std::runtime_error("write failed");
+    });
+  } catch (const std::runtime_error &) {}
+  if (dictionary.size() != 10000 ||
+      *std::prev(dictionary.snapshot().end()) != 9999) {
+    ok = false;
+    std::printf("  throwing write was published\n");
+  }
+  std::size_t size = dictionary.write([](auto &working) {
+    working.insert(working.end(), 10001);
+    return working.size();
+  });
+  if (size != 10001 || dictionary.size() != 10001 ||
+      *std::prev(dictionary.snapshot().end()) != 10001) {
+    ok = false;
+    std::printf("  throwing write was not rolled back\n");
+  }
+  return ok;
+}
+
 int main() {
   bool ok = true;
   std::printf("Small dictionary tests\n");
 
-  if (test_small_trees()) {
+  if (test_small_trees<wb::tree<int>>()) {
     std::printf("  build, iterate, exchange, erase for small trees - ok\n");
   } else {
     std::printf("  build, iterate, exchange, erase for small trees - fail\n");
     ok = false;
   }
 
+  if (test_small_trees<wb::tree<int, wb::pool_allocator<int, 4>>>()) {
+    std::printf("  small trees with pool_allocator - ok\n");
+  } else {
+    std::printf("  small trees with pool_allocator - fail\n");
+    ok = false;
+  }
+
+  if (test_small_trees<wb::tree<int, wb::compact_pool_allocator<int, 4>>>()) {
+    std::printf("  small trees with compact_pool_allocator - ok\n");
+  } else {
+    std::printf("  small trees with compact_pool_allocator - fail\n");
+    ok = false;
+  }
+
   std::printf("Large dictionary tests\n");
 
   constexpr std::size_t repeat_count{64};
@@ -175,6 +2013,11 @@ int main() {
     auto b = dist(urbg);
     if (a > b) { std::swap(a, b); }
     auto [iter, jter] = dictionary.range_between(make_cmp(a), make_cmp(b));
+    if (i % 2) {
+      deletions += std::distance(iter, jter);
+      iter = dictionary.erase(iter, jter);
+      if (dictionary.size() != insertions - deletions) { goto out; }
+    }
     while (iter != jter) {
       iter = dictionary.erase(iter);
       ++deletions;
@@ -184,6 +2027,13 @@ int main() {
 
 out:
 
+  if (dictionary.valid()) {
+    std::printf("  structure test ok\n");
+  } else {
+    std::printf("  structure test failed\n");
+    ok = false;
+  }
+
   if (items_are_in_ascending_order(dictionary)) {
     std::printf("  item order test ok\n");
   } else {
@@ -228,6 +2078,36 @@ out:
     }
   }
 
+  ok = ok && test_pool_allocator();
+  ok = ok && test_assign();
+  ok = ok && test_copy_move(urbg);
+  ok = ok && test_reverse(urbg);
+  ok = ok && test_split_join(urbg);
+  ok = ok && test_erase_range(urbg);
+  ok = ok && test_order_statistics(urbg);
+  ok = ok && test_indexed_iterator(urbg);
+  ok = ok && test_finger_search(urbg);
+  ok = ok && test_descents(urbg);
+  ok = ok && test_batched_search(urbg);
+  ok = ok && test_frozen_tree(urbg);
+  std::printf("Test block_tree\n");
+  ok = ok && test_block_tree<wb::block_tree<int>>(urbg);
+  ok = ok && test_block_tree<wb::block_tree<int, 4>>(urbg);
+  ok = ok && test_stats();
+  ok = ok && test_balance_policy(urbg);
+  ok = ok && test_deferred_balance(urbg);
+  ok = ok && test_node_handles(urbg);
+  ok = ok && test_aggregate(urbg);
+  ok = ok && test_for_each(urbg);
+  ok = ok && test_image(urbg);
+  ok = ok && test_intrusive_tree(urbg);
+  ok = ok && test_parallel_for_each();
+  ok = ok && test_set_operations(urbg);
+  ok = ok && test_insert_sorted(urbg);
+  ok = ok && test_persistent_tree(urbg);
+  ok = ok && test_persistent_failures();
+  ok = ok && test_concurrent_tree();
+  ok = ok && test_sweep(urbg);
   ok = ok && test_range_between(urbg, true);
   ok = ok && test_range_between(urbg, false);
 